@@ -0,0 +1,79 @@
+/*
+ * Helpers shared by the benchmarks in this directory: each benchmark builds its images with
+ * mke2fs, runs every configuration in a child process, since the file system is initialized
+ * once per process, and prints one line per measurement.
+ */
+
+#pragma once
+
+#include "../ext2fsal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void make_image(const char *path, uint64_t blocks, uint32_t inodes)
+{
+    // fresh ext2 image of blocks 1 KiB blocks and at least inodes inodes
+    char command[4096];
+    snprintf(command, sizeof(command),
+             "mke2fs -q -F -t ext2 -b 1024 -I 128 -N %u %s %llu >/dev/null 2>&1",
+             inodes, path, (unsigned long long) blocks);
+    unlink(path);
+    if (system(command) != 0) {
+        fprintf(stderr, "mke2fs failed for %s (is it installed?)\n", path);
+        exit(1);
+    }
+}
+
+static inline void write_source(const char *path, uint64_t size)
+{
+    // host file of size bytes of non-zero data
+    static char buf[1 << 16];
+    memset(buf, 0xa5, sizeof(buf));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        exit(1);
+    }
+    for (uint64_t done = 0; done < size;) {
+        size_t len = (size - done < sizeof(buf)) ? size - done : sizeof(buf);
+        if (write(fd, buf, len) != (ssize_t) len) {
+            perror(path);
+            exit(1);
+        }
+        done += len;
+    }
+    close(fd);
+}
+
+static inline void run_child(void (*run)(void *), void *arg)
+{
+    // runs one configuration in a child process, exits if it failed
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        run(arg);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "benchmark run failed\n");
+        exit(1);
+    }
+}
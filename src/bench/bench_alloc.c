@@ -0,0 +1,66 @@
+/*
+ * Allocation cost as the image fills: a filler file takes a share of the free blocks, then
+ * a small file is copied over and over to the same path, so each cp frees and allocates the
+ * same number of blocks. Constant time per cp at every fill level means the allocators do
+ * not rescan the used part of the bitmaps.
+ *
+ *   bench/bench_alloc [blocks]     (default 128, the size of the course images)
+ */
+
+#include "bench.h"
+#include "../ext2.h"
+
+#define IMAGE "/tmp/ext2fsal_bench_alloc.img"
+#define FILLER "/tmp/ext2fsal_bench_alloc_filler"
+#define SOURCE "/tmp/ext2fsal_bench_alloc_src"
+#define SOURCE_BLOCKS 8
+#define ROUNDS 2000
+
+static uint32_t free_blocks(const char *image)
+{
+    struct ext2_super_block super;
+    int fd = open(image, O_RDONLY);
+    if (fd == -1 || pread(fd, &super, sizeof(super), 1024) != sizeof(super)) {
+        perror(image);
+        exit(1);
+    }
+    close(fd);
+    return super.s_free_blocks_count;
+}
+
+static void run_level(void *arg)
+{
+    ext2_fsal_init(IMAGE);
+    if (ext2_fsal_cp(FILLER, "/filler") != 0 || ext2_fsal_cp(SOURCE, "/f") != 0) {
+        fprintf(stderr, "setup failed\n");
+        exit(1);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < ROUNDS; i++) {
+        if (ext2_fsal_cp(SOURCE, "/f") != 0) {
+            fprintf(stderr, "cp failed\n");
+            exit(1);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    printf("%3d%% full: %6llu ns per cp of %d blocks\n", *(int *) arg,
+           (unsigned long long) (elapsed / ROUNDS), SOURCE_BLOCKS);
+    ext2_fsal_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t blocks = (argc > 1) ? strtoull(argv[1], NULL, 0) : 128;
+    static const int levels[] = { 0, 25, 50, 75, 90 };
+    write_source(SOURCE, SOURCE_BLOCKS * 1024);
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        make_image(IMAGE, blocks, 64);
+        // leave room for the copied file and the filler's indirect tables
+        uint64_t room = free_blocks(IMAGE) - 2 * SOURCE_BLOCKS;
+        uint64_t filler_blocks = room * levels[i] / 100;
+        filler_blocks -= (filler_blocks > 2) ? filler_blocks / 257 + 2 : filler_blocks;
+        write_source(FILLER, filler_blocks * 1024);
+        run_child(run_level, (void *) &levels[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * cp throughput: sources from 1 KiB to 1 GiB are copied into a 1.5 GiB image, small ones
+ * many times over the same path; with "workers", one large source is copied with 1 to 8
+ * threads. The sources are in the page cache, so this measures the copy into the mapping.
+ *
+ *   bench/bench_cp
+ *   bench/bench_cp workers [MiB]   (default 256)
+ */
+
+#include "bench.h"
+
+#define IMAGE "/tmp/ext2fsal_bench_cp.img"
+#define SOURCE "/tmp/ext2fsal_bench_cp_src"
+#define IMAGE_BLOCKS (1536 * 1024)
+#define MiB (1024 * 1024)
+
+static void report(const char *what, uint64_t bytes, uint64_t elapsed)
+{
+    printf("%-14s %10.1f MiB/s\n", what, (double) bytes / MiB / (elapsed / 1e9));
+}
+
+static void copy_sizes(void *arg)
+{
+    ext2_fsal_init(IMAGE);
+    for (uint64_t size = 1024; size <= 1024 * MiB; size *= 4) {
+        write_source(SOURCE, size);
+        uint64_t rounds = (64 * MiB) / size;
+        rounds = (rounds < 1) ? 1 : (rounds > 2000) ? 2000 : rounds;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < rounds; i++) {
+            if (ext2_fsal_cp(SOURCE, "/f") != 0) {
+                fprintf(stderr, "cp of %llu bytes failed\n", (unsigned long long) size);
+                exit(1);
+            }
+        }
+        char what[32];
+        if (size < MiB) {
+            snprintf(what, sizeof(what), "%llu KiB", (unsigned long long) size / 1024);
+        }
+        else {
+            snprintf(what, sizeof(what), "%llu MiB", (unsigned long long) size / MiB);
+        }
+        report(what, size * rounds, now_ns() - start);
+    }
+    ext2_fsal_destroy();
+}
+
+static void copy_with_workers(void *arg)
+{
+    struct ext2_fsal_options options;
+    memset(&options, 0, sizeof(options));
+    options.cp_workers = (arg != NULL) ? *(uint32_t *) arg : 1;
+    options.cp_parallel_threshold = 1;
+    ext2_fsal_init_with_options(IMAGE, &options);
+    // the first copy maps the blocks, the timed one overwrites them
+    uint64_t elapsed = 0;
+    for (int i = 0; i < 2; i++) {
+        uint64_t start = now_ns();
+        if (ext2_fsal_cp(SOURCE, "/f") != 0) {
+            fprintf(stderr, "cp failed\n");
+            exit(1);
+        }
+        elapsed = now_ns() - start;
+    }
+    if (arg != NULL) {
+        char what[32];
+        snprintf(what, sizeof(what), "%u workers", options.cp_workers);
+        struct stat st;
+        stat(SOURCE, &st);
+        report(what, st.st_size, elapsed);
+    }
+    ext2_fsal_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    make_image(IMAGE, IMAGE_BLOCKS, 1024);
+    if (argc > 1 && strcmp(argv[1], "workers") == 0) {
+        uint64_t mib = (argc > 2) ? strtoull(argv[2], NULL, 0) : 256;
+        static const uint32_t workers[] = { 1, 2, 4, 8 };
+        write_source(SOURCE, mib * MiB);
+        printf("%llu MiB source, %ld CPUs\n", (unsigned long long) mib, sysconf(_SC_NPROCESSORS_ONLN));
+        // an untimed run first, so no configuration pays for the image file getting its blocks
+        run_child(copy_with_workers, NULL);
+        for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+            run_child(copy_with_workers, (void *) &workers[i]);
+        }
+    }
+    else {
+        run_child(copy_sizes, NULL);
+    }
+    unlink(SOURCE);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Name lookup cost against directory size: /d gets n hard links to one empty file, then
+ * mkdir of a name /d holds (EEXIST) and a hard link from a name it does not hold (ENOENT)
+ * are timed, each of which is a path lookup and nothing else.
+ *
+ *   bench/bench_lookup
+ */
+
+#include "bench.h"
+
+#define IMAGE "/tmp/ext2fsal_bench_lookup.img"
+#define SOURCE "/tmp/ext2fsal_bench_lookup_src"
+#define LOOKUPS 20000
+
+static void run_size(void *arg)
+{
+    uint32_t entries = *(uint32_t *) arg;
+    char path[64];
+    ext2_fsal_init(IMAGE);
+    if (ext2_fsal_mkdir("/d") != 0 || ext2_fsal_cp(SOURCE, "/f") != 0) {
+        fprintf(stderr, "setup failed\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < entries; i++) {
+        snprintf(path, sizeof(path), "/d/e%05u", i);
+        if (ext2_fsal_ln_hl("/f", path) != 0) {
+            fprintf(stderr, "ln %s failed\n", path);
+            exit(1);
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        snprintf(path, sizeof(path), "/d/e%05u", (i * 7919) % entries);
+        if (ext2_fsal_mkdir(path) != EEXIST) {
+            fprintf(stderr, "mkdir %s did not fail with EEXIST\n", path);
+            exit(1);
+        }
+    }
+    uint64_t hit = (now_ns() - start) / LOOKUPS;
+
+    start = now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        snprintf(path, sizeof(path), "/d/m%05u", (i * 7919) % entries);
+        if (ext2_fsal_ln_hl(path, "/x") != ENOENT) {
+            fprintf(stderr, "ln %s did not fail with ENOENT\n", path);
+            exit(1);
+        }
+    }
+    uint64_t miss = (now_ns() - start) / LOOKUPS;
+    printf("%4u entries: %6llu ns per hit, %6llu ns per miss\n", entries,
+           (unsigned long long) hit, (unsigned long long) miss);
+    ext2_fsal_destroy();
+}
+
+int main(void)
+{
+    // a 128-block image: at 64 entries per block, the largest size takes 10 directory blocks
+    static const uint32_t sizes[] = { 16, 64, 256, 640 };
+    write_source(SOURCE, 0);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        make_image(IMAGE, 128, 32);
+        run_child(run_size, (void *) &sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Startup and first touch against the mapping options: time of ext2_fsal_init(), of the
+ * first mkdir (super block, group descriptors, bitmaps, inode table and root directory are
+ * touched for the first time) and of the first cp of 256 KiB, with the image evicted from
+ * the page cache (cold) and right after a previous run (warm).
+ *
+ *   bench/bench_startup [MiB]      (default 8)
+ */
+
+#include "bench.h"
+
+#define IMAGE "/tmp/ext2fsal_bench_startup.img"
+#define SOURCE "/tmp/ext2fsal_bench_startup_src"
+
+struct config {
+    const char *name;
+    struct ext2_fsal_options options;
+    int run;
+};
+
+static void evict_image(void)
+{
+    // drop the clean pages of the image from the page cache
+    int fd = open(IMAGE, O_RDWR);
+    if (fd == -1 || fsync(fd) == -1) {
+        perror(IMAGE);
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void run_config(void *arg)
+{
+    struct config *config = arg;
+    char dir[64], file[80];
+    snprintf(dir, sizeof(dir), "/%s%d", config->name, config->run);
+    snprintf(file, sizeof(file), "%s/f", dir);
+    uint64_t start = now_ns();
+    ext2_fsal_init_with_options(IMAGE, &config->options);
+    uint64_t init = now_ns() - start;
+
+    start = now_ns();
+    int res = ext2_fsal_mkdir(dir);
+    uint64_t mkdir = now_ns() - start;
+
+    start = now_ns();
+    res |= ext2_fsal_cp(SOURCE, file);
+    uint64_t cp = now_ns() - start;
+    if (res != 0) {
+        fprintf(stderr, "mkdir or cp failed\n");
+        exit(1);
+    }
+    ext2_fsal_rm(file);
+    printf("    %-16s init %8.3f ms, first mkdir %8.3f ms, first cp %8.3f ms\n", config->name,
+           init / 1e6, mkdir / 1e6, cp / 1e6);
+    ext2_fsal_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t mib = (argc > 1) ? strtoull(argv[1], NULL, 0) : 8;
+    static struct config configs[] = {
+        { "default", { 0 } },
+        { "map_populate", { .map_populate = true } },
+        { "willneed", { .map_advice = EXT2_FSAL_ADVICE_WILLNEED } },
+        { "sequential", { .map_advice = EXT2_FSAL_ADVICE_SEQUENTIAL } },
+        { "huge_pages", { .huge_pages = true } },
+    };
+    write_source(SOURCE, 256 * 1024);
+    make_image(IMAGE, mib * 1024, 1024);
+    for (int cold = 1; cold >= 0; cold--) {
+        printf("%llu MiB image, %s page cache:\n", (unsigned long long) mib, cold ? "cold" : "warm");
+        for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+            if (cold) {
+                evict_image();
+            }
+            configs[i].run = cold;
+            run_child(run_config, &configs[i]);
+        }
+    }
+    return 0;
+}
@@ -15,6 +15,8 @@
  * TODO: Make sure to add all necessary includes here
  */
 
+#define _GNU_SOURCE // fallocate(), SCHED_IDLE
+#include "ext2fsal.h"
 #include "e2fs.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +24,12 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
 
  /**
   * TODO: Add any helper implementations here
@@ -29,148 +37,2265 @@
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
 extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char* inode_bitmap;
-extern struct ext2_inode *inode_table;
-extern pthread_mutex_t inode_bitmap_lock;
-extern pthread_mutex_t datablock_bitmap_lock;
+extern uint32_t group_count;
+extern size_t disk_size;
+extern int image_fd;
+extern bool image_private;
 extern pthread_mutex_t superblock_lock;
 extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
+extern uint32_t *inode_view_pins;
+
+// Geometry of the block groups, see ext2_fsal_init(). Group g owns inodes
+// [g * s_inodes_per_group + 1, (g + 1) * s_inodes_per_group] and blocks
+// [s_first_data_block + g * s_blocks_per_group, ...), the last group may be shorter.
+static unsigned char* group_block_bitmap(uint32_t group) {
+    return disk + (size_t) gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE;
+}
 
-char* get_normalized_path(const char* path) {
-    size_t original_len = strlen(path);
-    char* normalized_path = malloc(original_len + 1);
-    char prev, curr;
-    prev = path[0];
-    normalized_path[0] = prev;
-    size_t normalized_len = 1;
-
-    for (int i = 1; i < original_len; i++) {
-        curr = path[i];
-        // ignore duplicate slashes
-        if (curr == prev && curr == '/') {
-            continue;
-        } 
-        // ignore trailing slash
-        else if (i == original_len - 1 && curr == '/') {
-            continue;
-        } 
-        // valid char at this point
+static unsigned char* group_inode_bitmap(uint32_t group) {
+    return disk + (size_t) gd[group].bg_inode_bitmap * EXT2_BLOCK_SIZE;
+}
+
+static uint32_t group_block_count(uint32_t group) {
+    // number of bits used in the block bitmap of group
+    uint32_t first = group * sb->s_blocks_per_group;
+    uint32_t total = sb->s_blocks_count - sb->s_first_data_block;
+    return (total - first < sb->s_blocks_per_group) ? total - first : sb->s_blocks_per_group;
+}
+
+static uint32_t group_first_free_ino_bit(uint32_t group) {
+    // inodes below EXT2_GOOD_OLD_FIRST_INO are reserved (root included), so never hand them out
+    return (group == 0) ? EXT2_GOOD_OLD_FIRST_INO : 0;
+}
+
+static uint32_t block_group(int block_num) {
+    return (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+uint32_t inode_group(int inode_num) {
+    return (inode_num - 1) / sb->s_inodes_per_group;
+}
+
+struct ext2_inode* get_inode(int inode_num) {
+    // inodes are s_inode_size bytes apart in the table, which may be more than the struct
+    uint32_t index = (inode_num - 1) % sb->s_inodes_per_group;
+    uint32_t inode_size = (sb->s_rev_level == 0) ? sizeof(struct ext2_inode) : sb->s_inode_size;
+    return (struct ext2_inode*) (disk + (size_t) gd[inode_group(inode_num)].bg_inode_table * EXT2_BLOCK_SIZE
+                                 + index * inode_size);
+}
+
+// next-fit cursors: each search resumes right after the bit handed out last time,
+// so a run of allocations does not rescan the already used prefix of the bitmap.
+// Cursors are per thread and start in a zone of their own (see alloc_zone_start()),
+// so concurrent allocators rarely claim bits in the same cacheline. A cursor only
+// remembers a position inside the group it last allocated from.
+#define ALLOC_CURSOR_UNSET UINT32_MAX
+struct alloc_cursor {
+    uint32_t group;
+    uint32_t bit;
+};
+static __thread struct alloc_cursor inode_alloc_cursor = { ALLOC_CURSOR_UNSET, 0 };
+static __thread struct alloc_cursor block_alloc_cursor = { ALLOC_CURSOR_UNSET, 0 };
+
+// number of zones the bitmaps are split into, zones are a multiple of one cacheline (512 bits)
+#define ALLOC_ZONES 16
+#define ALLOC_ZONE_ALIGN_BITS 512
+
+static uint32_t alloc_next_thread_idx = 0;
+static __thread int alloc_thread_idx = -1;
+
+// Durability: every operation records which part of the mapping it changed, and commit_op()
+// makes the changes reach the image file as configured by set_durability():
+// - EXT2_FSAL_DURABILITY_NONE: nothing is recorded, the kernel writes pages back eventually
+// - EXT2_FSAL_DURABILITY_PER_OP: each operation msyncs its own changes before returning
+// - EXT2_FSAL_DURABILITY_GROUP: operations finishing while a commit runs (or within the
+//   group commit window) are committed together with a single msync
+// A commit always covers the super block and group descriptors at the start of the image,
+// after folding the batched free counts into them, so one msync of [0, end of the furthest
+// change) covers a whole batch. msync only writes the dirty pages in the range it is given,
+// so the cost is that of the changed pages plus one flush of the file.
+//
+// With the metadata journal open (see open_journal()), metadata only reaches the image at a
+// checkpoint: the image is mapped privately, so the kernel never writes a page back on its own.
+// Each operation logs a copy of the metadata it changed (inodes, directory blocks, indirect
+// tables), the bitmap bits it flipped and the blocks it freed, and commit_op() adds those
+// records to the running transaction, which every operation between begin_op() and
+// commit_op() belongs to. A commit closes the running transaction once the operations in it
+// are done, so an operation that saw the changes of another one never commits before it; it
+// fdatasyncs the file data they wrote (cp writes data to the image file as well as to the
+// mapping) and appends the transaction to the journal. In mode NONE nothing waits for that,
+// and the running transaction is only committed once it freed blocks or outgrew
+// JOURNAL_RUNNING_BYTES. Blocks freed by a transaction stay allocated until it is committed,
+// so no new data overwrites them while a crash could still bring them back. The metadata
+// journaled since the last checkpoint is written back once the journal would outgrow
+// JOURNAL_CHECKPOINT_BYTES, and the journal starts over.
+static int durability_mode = EXT2_FSAL_DURABILITY_NONE;
+static uint32_t group_commit_us;
+static uint32_t group_commit_ops;
+
+// [start, end) of the changes made by the calling thread's current operation; with the journal
+// open this only covers file data, metadata goes to op_records
+static __thread size_t op_dirty_start = SIZE_MAX;
+static __thread size_t op_dirty_end = 0;
+
+// group commit state, guarded by commit_lock
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static size_t pending_start = SIZE_MAX;
+static size_t pending_end = 0;
+static uint32_t pending_ops = 0;
+static uint64_t next_commit_ticket = 1;     // ticket of the next operation to join a batch
+static uint64_t committed_ticket = 0;      // every operation up to this ticket is durable
+static bool commit_in_progress = false;
+
+// Journal layout: a sequence of transactions, in the order they were closed. A transaction is
+// a header followed by its records, a record is a header followed by len bytes of data:
+// - JOURNAL_BYTES: the data is the new content of [offset, offset + len) of the image
+// - JOURNAL_SET_BITS / JOURNAL_CLEAR_BITS: the data is a 64-bit mask of bits to set or clear
+//   in the bitmap word at offset; bits are logged one word at a time, not as a copy of the
+//   word, because concurrent operations flip other bits of the same word
+// - JOURNAL_REVOKE: the data is a 32-bit count of blocks, starting with the block at offset,
+//   that were freed; replay clears their bits and skips what earlier records wrote to them,
+//   since a freed table or directory block may be holding file data (which is never
+//   journaled) by the time of a crash
+// The records of the operations in one transaction interleave, so every record carries a
+// sequence number taken when it was logged, and replay applies records in that order.
+#define JOURNAL_MAGIC 0x4c4e524aU   // "JRNL"
+
+struct journal_txn_header {
+    uint32_t magic;
+    uint32_t records;       // number of records in the transaction
+    uint64_t len;           // bytes of records following the header
+    uint64_t checksum;      // see journal_checksum()
+};
+
+enum journal_record_type {
+    JOURNAL_BYTES,
+    JOURNAL_SET_BITS,
+    JOURNAL_CLEAR_BITS,
+    JOURNAL_REVOKE
+};
+
+struct journal_record {
+    uint32_t type;
+    uint32_t len;           // bytes of data following the record
+    uint64_t seq;
+    uint64_t offset;        // in the image
+};
+
+// the journal file, -1 when journaling is off; only changed by open_journal() / close_journal()
+static int journal_fd = -1;
+static uint64_t journal_next_seq = 0;
+
+// the running transaction, guarded by journal_lock: the records of the operations that
+// called commit_op() since it was opened. The operations between begin_op() and commit_op()
+// are its updates; it is only closed once there are none, and operations beginning while it
+// is being closed (running_locked) wait for the next one.
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static unsigned char* running_records = NULL;
+static size_t running_len = 0;
+static size_t running_cap = 0;
+static uint32_t running_count = 0;
+static bool running_lost = false;       // the records of an operation did not fit in memory
+static bool running_data = false;       // an operation wrote file data to the image file
+static uint32_t running_updates = 0;
+static bool running_locked = false;
+static uint64_t running_tid = 1;
+// transaction of the calling thread's operation, 0 outside of begin_op() / commit_op()
+static __thread uint64_t op_tid = 0;
+
+// one committer at a time, guards journal_size and the transaction ids below
+static pthread_mutex_t journal_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t journal_size = 0;
+static uint64_t written_tid = 0;        // transactions up to this one are in the journal file
+static uint64_t synced_tid = 0;         // and on disk
+
+// metadata blocks journaled since the last checkpoint, one bit per block, only kept with the
+// private mapping of a journaled image (see write_back_image())
+static uint64_t* journal_dirty_blocks = NULL;
+
+// defined with the block allocator
+static void release_revoked_blocks(const unsigned char* records, size_t len);
+
+// records of the calling thread's current operation; the buffer is freed when the thread
+// exits, or after an operation that needed a large one (e.g. the indirect tables of a big cp)
+#define OP_RECORDS_KEEP (64 * 1024)
+struct op_records {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+    uint32_t count;
+    bool lost;              // a record did not fit in memory
+    bool freed;             // blocks were freed, see journal_revoke()
+    size_t last_revoke;     // offset of a revoke record that may be extended, or SIZE_MAX
+};
+static __thread struct op_records op_records = { NULL, 0, 0, 0, false, false, SIZE_MAX };
+static pthread_key_t op_records_key;
+static pthread_once_t op_records_key_once = PTHREAD_ONCE_INIT;
+
+static void create_op_records_key() {
+    pthread_key_create(&op_records_key, free);
+}
+
+static void mark_journaled(size_t offset, size_t len) {
+    // the blocks of [offset, offset + len) are written back at the next checkpoint
+    if (journal_dirty_blocks == NULL || len == 0) {
+        return;
+    }
+    for (size_t block = offset / EXT2_BLOCK_SIZE; block <= (offset + len - 1) / EXT2_BLOCK_SIZE; block++) {
+        __atomic_fetch_or(&journal_dirty_blocks[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static void journal_log(uint32_t type, size_t offset, const void* data, uint32_t len) {
+    // add a record to the calling thread's current operation
+    if (type != JOURNAL_REVOKE) {
+        mark_journaled(offset, len);
+    }
+    if (op_records.lost) {
+        return;
+    }
+    size_t needed = op_records.len + sizeof(struct journal_record) + len;
+    if (needed > op_records.cap) {
+        size_t cap = (op_records.cap > 0) ? op_records.cap * 2 : 4096;
+        while (cap < needed) {
+            cap *= 2;
+        }
+        unsigned char* grown = realloc(op_records.data, cap);
+        if (grown == NULL) {
+            op_records.lost = true;
+            return;
+        }
+        pthread_once(&op_records_key_once, create_op_records_key);
+        pthread_setspecific(op_records_key, grown);
+        op_records.data = grown;
+        op_records.cap = cap;
+    }
+
+    struct journal_record record = { type, len, __atomic_fetch_add(&journal_next_seq, 1, __ATOMIC_RELAXED), offset };
+    memcpy(op_records.data + op_records.len, &record, sizeof(record));
+    memcpy(op_records.data + op_records.len + sizeof(record), data, len);
+    if (type == JOURNAL_REVOKE) {
+        op_records.last_revoke = op_records.len;
+    } else if (type == JOURNAL_BYTES) {
+        op_records.last_revoke = SIZE_MAX;
+    }
+    op_records.len = needed;
+    op_records.count++;
+}
+
+static void journal_revoke(uint32_t block_num) {
+    // block_num was freed by the current operation; a run of blocks freed one after the other
+    // shares one record, which is only extended while no block was written in between
+    // (bitmap records do not matter, replay never skips them)
+    if (journal_fd == -1) {
+        return;
+    }
+    op_records.freed = true;
+    size_t offset = (size_t) block_num * EXT2_BLOCK_SIZE;
+    if (op_records.last_revoke != SIZE_MAX && !op_records.lost) {
+        struct journal_record last;
+        uint32_t count;
+        memcpy(&last, op_records.data + op_records.last_revoke, sizeof(last));
+        memcpy(&count, op_records.data + op_records.last_revoke + sizeof(last), sizeof(count));
+        if (last.type == JOURNAL_REVOKE && last.offset + (size_t) count * EXT2_BLOCK_SIZE == offset && count < UINT32_MAX) {
+            count++;
+            memcpy(op_records.data + op_records.last_revoke + sizeof(last), &count, sizeof(count));
+            return;
+        }
+    }
+    uint32_t count = 1;
+    journal_log(JOURNAL_REVOKE, offset, &count, sizeof(count));
+}
+
+static void reset_op_records() {
+    op_records.len = 0;
+    op_records.count = 0;
+    op_records.lost = false;
+    op_records.freed = false;
+    op_records.last_revoke = SIZE_MAX;
+    if (op_records.cap > OP_RECORDS_KEEP) {
+        pthread_setspecific(op_records_key, NULL);
+        free(op_records.data);
+        op_records.data = NULL;
+        op_records.cap = 0;
+    }
+}
+
+static uint64_t journal_checksum(const struct journal_txn_header* header, const unsigned char* records) {
+    // FNV-1a over the record count, length and records, enough to tell a torn write
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t fields[2] = { header->records, header->len };
+    const unsigned char* parts[2] = { (const unsigned char*) fields, records };
+    size_t lens[2] = { sizeof(fields), header->len };
+    for (int part = 0; part < 2; part++) {
+        for (size_t i = 0; i < lens[part]; i++) {
+            hash ^= parts[part][i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+void set_durability(int mode, uint32_t window_us, uint32_t max_ops) {
+    pthread_mutex_lock(&commit_lock);
+    group_commit_us = window_us;
+    group_commit_ops = (max_ops > 0) ? max_ops : 1;
+    __atomic_store_n(&durability_mode, mode, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&commit_lock);
+}
+
+static void mark_range_dirty(size_t start, size_t end) {
+    if (__atomic_load_n(&durability_mode, __ATOMIC_RELAXED) == EXT2_FSAL_DURABILITY_NONE) {
+        return;
+    }
+    if (start < op_dirty_start) {
+        op_dirty_start = start;
+    }
+    if (end > op_dirty_end) {
+        op_dirty_end = end;
+    }
+}
+
+void mark_dirty(const void* addr, size_t len) {
+    // record that metadata in [addr, addr + len) of the mapping was changed by the current
+    // operation; with the journal open, its new content is logged right away, so callers mark
+    // a change once it is complete and while they still hold the locks protecting it
+    size_t offset = (const unsigned char*) addr - disk;
+    if (journal_fd != -1) {
+        journal_log(JOURNAL_BYTES, offset, addr, len);
+        return;
+    }
+    mark_range_dirty(offset, offset + len);
+}
+
+void mark_inode_dirty(int inode_num) {
+    mark_dirty(get_inode(inode_num), sizeof(struct ext2_inode));
+}
+
+void mark_blocks_dirty(uint32_t first_block, uint32_t count) {
+    mark_dirty(disk + (size_t) first_block * EXT2_BLOCK_SIZE, (size_t) count * EXT2_BLOCK_SIZE);
+}
+
+void mark_data_dirty(uint32_t first_block, uint32_t count) {
+    // file data is never journaled, it is written in place before the metadata pointing to it
+    size_t start = (size_t) first_block * EXT2_BLOCK_SIZE;
+    mark_range_dirty(start, start + (size_t) count * EXT2_BLOCK_SIZE);
+}
+
+static void mark_bits_dirty(uint64_t* word, uint64_t mask, bool set) {
+    // bits in mask of a bitmap word were set or cleared
+    if (journal_fd != -1) {
+        journal_log(set ? JOURNAL_SET_BITS : JOURNAL_CLEAR_BITS, (unsigned char*) word - disk, &mask, sizeof(mask));
+        return;
+    }
+    mark_range_dirty((unsigned char*) word - disk, (unsigned char*) word - disk + sizeof(uint64_t));
+}
+
+static bool write_all(int fd, const void* data, size_t len, off_t offset) {
+    // pwrite() until everything is written, false (after reporting why) if that failed
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pwrite(fd, (const unsigned char*) data + done, len - done, offset + done);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+bool write_image_range(size_t offset, size_t len) {
+    // copy [offset, offset + len) of the mapping to the image file, for a private mapping
+    return write_all(image_fd, disk + offset, len, offset);
+}
+
+static bool write_back_image() {
+    /* Return value interpretation:
+     * false -> the image file could not be written, it may miss some changes
+     * true -> the image file holds what the mapping holds and is on disk
+     *
+     * A shared mapping is msynced. A private one (journal on) is written block by block: the
+     * blocks journaled or replayed since the last write-back, and the super block and group
+     * descriptors; file data reaches the file when it is written. Only called while no
+     * operation runs.
+     */
+    if (!image_private) {
+        if (msync(disk, disk_size, MS_SYNC) == -1) {
+            perror("msync");
+            return false;
+        }
+        return true;
+    }
+    size_t meta_end = (sb->s_first_data_block + 1) * EXT2_BLOCK_SIZE + group_count * sizeof(struct ext2_group_desc);
+    bool written = write_image_range(0, meta_end);
+    size_t nwords = (disk_size / EXT2_BLOCK_SIZE + 63) / 64;
+    size_t run_start = 0;
+    size_t run_len = 0;
+    for (size_t word = 0; word < nwords && journal_dirty_blocks != NULL; word++) {
+        for (uint64_t bits = journal_dirty_blocks[word]; bits != 0; bits &= bits - 1) {
+            size_t block = word * 64 + __builtin_ctzll(bits);
+            if (run_len > 0 && run_start + run_len == block) {
+                run_len++;
+                continue;
+            }
+            if (run_len > 0 && !write_image_range(run_start * EXT2_BLOCK_SIZE, run_len * EXT2_BLOCK_SIZE)) {
+                written = false;
+            }
+            run_start = block;
+            run_len = 1;
+        }
+    }
+    if (run_len > 0 && !write_image_range(run_start * EXT2_BLOCK_SIZE, run_len * EXT2_BLOCK_SIZE)) {
+        written = false;
+    }
+    if (fdatasync(image_fd) == -1) {
+        perror("fdatasync");
+        written = false;
+    }
+    // the blocks stay marked if anything failed, the next checkpoint writes them again
+    if (written && journal_dirty_blocks != NULL) {
+        memset(journal_dirty_blocks, 0, nwords * sizeof(uint64_t));
+    }
+    return written;
+}
+
+static bool checkpoint_journal_locked() {
+    // write the image back, after which the journal holds nothing worth replaying; called
+    // with journal_flush_lock held and no operation running, false if the image could not be
+    // written (the journal is kept then)
+    sync_free_counts();
+    if (!write_back_image()) {
+        return false;
+    }
+    if (ftruncate(journal_fd, 0) == -1 || fsync(journal_fd) == -1) {
+        perror("journal");
+        return false;
+    }
+    journal_size = 0;
+    return true;
+}
+
+static void lock_running_transaction() {
+    // wait until no operation is part of the running transaction and keep new ones from
+    // joining it; returns with journal_lock held
+    pthread_mutex_lock(&journal_lock);
+    running_locked = true;
+    while (running_updates > 0) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+}
+
+static void unlock_running_transaction() {
+    running_locked = false;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static bool write_transaction_locked(struct journal_txn_header* header, const unsigned char* records, bool data, bool wait) {
+    // append a transaction to the journal file; with wait, the file data its operations wrote
+    // goes to disk first and the transaction right after; called with journal_flush_lock held
+    if (wait && data && fdatasync(image_fd) == -1) {
+        perror("fdatasync");
+        return false;
+    }
+    if (header->len == 0) {
+        return true;
+    }
+    header->checksum = journal_checksum(header, records);
+    if (!write_all(journal_fd, header, sizeof(*header), journal_size)
+        || !write_all(journal_fd, records, header->len, journal_size + sizeof(*header))
+        || (wait && fdatasync(journal_fd) == -1)) {
+        perror("journal");
+        return false;
+    }
+    journal_size += sizeof(*header) + header->len;
+    return true;
+}
+
+static void commit_running_locked(bool wait, bool checkpoint) {
+    // close the running transaction and write it to the journal, or (checkpoint, or when the
+    // journal would grow too large) write the image back while nothing runs; called with
+    // journal_flush_lock held
+    lock_running_transaction();
+    unsigned char* records = running_records;
+    struct journal_txn_header header = { JOURNAL_MAGIC, running_count, running_len, 0 };
+    bool lost = running_lost;
+    bool data = running_data;
+    uint64_t tid = running_tid++;
+    running_records = NULL;
+    running_len = 0;
+    running_cap = 0;
+    running_count = 0;
+    running_lost = false;
+    running_data = false;
+
+    // the image as it is now holds every finished operation and nothing else; the blocks
+    // freed by a transaction whose records were lost stay allocated until e2fsck finds them
+    bool released = false;
+    if (lost || checkpoint || journal_size + sizeof(header) + header.len > JOURNAL_CHECKPOINT_BYTES) {
+        if (!lost) {
+            release_revoked_blocks(records, header.len);
+            released = true;
+        }
+        checkpoint = checkpoint_journal_locked() || lost;
+    }
+    unlock_running_transaction();
+
+    if (!checkpoint) {
+        if (!write_transaction_locked(&header, records, data, wait)) {
+            // the journal is unusable for this transaction, write the image back instead
+            lock_running_transaction();
+            if (!released) {
+                release_revoked_blocks(records, header.len);
+                released = true;
+            }
+            checkpoint_journal_locked();
+            unlock_running_transaction();
+        }
+        if (!released) {
+            release_revoked_blocks(records, header.len);
+        }
+    }
+    free(records);
+    written_tid = tid;
+    if (wait || checkpoint) {
+        synced_tid = tid;
+    }
+}
+
+static void commit_transaction(uint64_t tid, bool wait) {
+    // make transaction tid and the ones before it reach the journal file, and the disk with wait
+    pthread_mutex_lock(&journal_flush_lock);
+    if (written_tid < tid) {
+        commit_running_locked(wait, false);
+    }
+    else if (wait && synced_tid < tid) {
+        // written without waiting, e.g. in mode NONE
+        if (fdatasync(image_fd) == -1 || fdatasync(journal_fd) == -1) {
+            perror("fdatasync");
+        }
+        synced_tid = written_tid;
+    }
+    pthread_mutex_unlock(&journal_flush_lock);
+}
+
+void begin_op() {
+    // called at the start of every operation, before any lock is taken: joins the running
+    // transaction, after waiting for it to be reopened if it is being closed
+    if (journal_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    while (running_locked) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    running_updates++;
+    op_tid = running_tid;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static uint64_t end_journal_update() {
+    // add the records of the calling thread's operation to the running transaction and leave
+    // it, returns the transaction
+    pthread_mutex_lock(&journal_lock);
+    if (op_records.lost) {
+        running_lost = true;
+    }
+    else if (op_records.len > 0) {
+        size_t needed = running_len + op_records.len;
+        if (needed > running_cap) {
+            size_t cap = (running_cap > 0) ? running_cap * 2 : 64 * 1024;
+            while (cap < needed) {
+                cap *= 2;
+            }
+            unsigned char* grown = realloc(running_records, cap);
+            if (grown != NULL) {
+                running_records = grown;
+                running_cap = cap;
+            }
+        }
+        if (needed <= running_cap) {
+            memcpy(running_records + running_len, op_records.data, op_records.len);
+            running_len = needed;
+            running_count += op_records.count;
+        }
         else {
-            normalized_path[normalized_len] = curr;
-            prev = curr;
-            normalized_len++;
+            // out of memory: the transaction is written back as part of the image instead
+            running_lost = true;
+        }
+    }
+    if (op_dirty_start < op_dirty_end) {
+        running_data = true;
+    }
+    uint64_t tid = (op_tid != 0) ? op_tid : running_tid;
+    if (op_tid != 0 && --running_updates == 0 && running_locked) {
+        pthread_cond_broadcast(&journal_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    op_tid = 0;
+    reset_op_records();
+    return tid;
+}
+
+static void sync_changes(size_t start, size_t end) {
+    // make the changes in [start, end) of the mapping durable
+    if (journal_fd != -1) {
+        // the file data is in the image file already, committing fdatasyncs it first
+        commit_transaction(__atomic_load_n(&running_tid, __ATOMIC_RELAXED), true);
+        return;
+    }
+
+    // write the file system counters back as well
+    sync_free_counts();
+
+    // the super block and the group descriptor table hold the counters just folded
+    size_t meta_end = (sb->s_first_data_block + 1) * EXT2_BLOCK_SIZE + group_count * sizeof(struct ext2_group_desc);
+    if (end < meta_end) {
+        end = meta_end;
+    }
+    if (msync(disk, end, MS_SYNC) == -1) {
+        perror("msync");
+    }
+}
+
+static void group_commit() {
+    pthread_mutex_lock(&commit_lock);
+    if (op_dirty_start < pending_start) {
+        pending_start = op_dirty_start;
+    }
+    if (op_dirty_end > pending_end) {
+        pending_end = op_dirty_end;
+    }
+    uint64_t ticket = next_commit_ticket++;
+    pending_ops++;
+    if (pending_ops >= group_commit_ops) {
+        // a full batch, a leader waiting for the window to close can go ahead
+        pthread_cond_broadcast(&commit_cond);
+    }
+
+    while (committed_ticket < ticket) {
+        if (commit_in_progress) {
+            // a leader is committing an earlier batch, this operation goes into the next one
+            pthread_cond_wait(&commit_cond, &commit_lock);
+            continue;
+        }
+
+        // become the leader: give others the window to join, then commit the whole batch
+        commit_in_progress = true;
+        if (group_commit_us > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long) group_commit_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while (pending_ops < group_commit_ops
+                   && pthread_cond_timedwait(&commit_cond, &commit_lock, &deadline) == 0) {
+            }
+        }
+
+        size_t start = pending_start;
+        size_t end = pending_end;
+        uint64_t last_ticket = next_commit_ticket - 1;
+        pending_start = SIZE_MAX;
+        pending_end = 0;
+        pending_ops = 0;
+        pthread_mutex_unlock(&commit_lock);
+
+        sync_changes(start, end);
+
+        pthread_mutex_lock(&commit_lock);
+        committed_ticket = last_ticket;
+        commit_in_progress = false;
+        pthread_cond_broadcast(&commit_cond);
+    }
+    pthread_mutex_unlock(&commit_lock);
+}
+
+void sync_image() {
+    // write the whole mapping back, unless durability is off
+    if (__atomic_load_n(&durability_mode, __ATOMIC_RELAXED) != EXT2_FSAL_DURABILITY_NONE
+        && msync(disk, disk_size, MS_SYNC) == -1) {
+        perror("msync");
+    }
+}
+
+// defined with the free counts
+static void fold_thread_free_counts();
+
+void commit_op() {
+    // called once at the end of every operation, with no inode lock held
+    fold_thread_free_counts();
+    int mode = __atomic_load_n(&durability_mode, __ATOMIC_RELAXED);
+    if (journal_fd != -1) {
+        bool freed = op_records.freed;
+        uint64_t tid = end_journal_update();
+        switch (mode) {
+        case EXT2_FSAL_DURABILITY_PER_OP:
+            commit_transaction(tid, true);
+            break;
+        case EXT2_FSAL_DURABILITY_GROUP:
+            group_commit();
+            break;
+        default:
+            // nothing waits, but the blocks the operation freed can only be reused once it is written
+            if (freed || __atomic_load_n(&running_len, __ATOMIC_RELAXED) >= JOURNAL_RUNNING_BYTES) {
+                commit_transaction(tid, false);
+            }
+            break;
+        }
+    }
+    else {
+        switch (mode) {
+        case EXT2_FSAL_DURABILITY_PER_OP:
+            sync_changes(op_dirty_start, op_dirty_end);
+            break;
+        case EXT2_FSAL_DURABILITY_GROUP:
+            group_commit();
+            break;
+        default:
+            break;
+        }
+    }
+    op_dirty_start = SIZE_MAX;
+    op_dirty_end = 0;
+}
+
+// Bitmaps are always block aligned inside the mapping, so they can be accessed as arrays of
+// 64-bit words. Bit i of the bitmap is bit (i % 8) of byte (i / 8), which is exactly bit
+// (i % 64) of the little-endian 64-bit word holding it. Words are only read and modified with
+// atomics, which is what lets allocation run without a bitmap lock.
+static uint64_t load_bitmap_word(const unsigned char* bitmap, uint32_t word_idx) {
+    return __atomic_load_n((const uint64_t*) bitmap + word_idx, __ATOMIC_ACQUIRE);
+}
+
+static bool test_bitmap_bit(const unsigned char* bitmap, uint32_t bit) {
+    return (load_bitmap_word(bitmap, bit / 64) >> (bit % 64)) & 1;
+}
+
+static void clear_bitmap_bit(unsigned char* bitmap, uint32_t bit) {
+    __atomic_fetch_and((uint64_t*) bitmap + bit / 64, ~(1ULL << (bit % 64)), __ATOMIC_RELEASE);
+    mark_bits_dirty((uint64_t*) bitmap + bit / 64, 1ULL << (bit % 64), false);
+}
+
+int find_next_zero_bit(const unsigned char* bitmap, uint32_t nbits, uint32_t start) {
+    /*
+    Return value interpretation:
+    -1: every bit in [start, nbits) is set
+    other values: index of the first clear bit in [start, nbits)
+
+    Bitmaps always occupy a whole block, so reading the tail word past nbits stays
+    inside the bitmap block; bits beyond nbits are simply ignored.
+    */
+    if (start >= nbits) {
+        return -1;
+    }
+    uint32_t nwords = (nbits + 63) / 64;
+    uint32_t word_idx = start / 64;
+
+    // invert so free bits become set bits, then drop the bits before start
+    uint64_t free_bits = ~load_bitmap_word(bitmap, word_idx) & (~0ULL << (start % 64));
+    while (free_bits == 0) {
+        // whole word is in use, skip it
+        word_idx++;
+        if (word_idx >= nwords) {
+            return -1;
+        }
+        free_bits = ~load_bitmap_word(bitmap, word_idx);
+    }
+
+    uint32_t bit = word_idx * 64 + __builtin_ctzll(free_bits);
+    return bit < nbits ? (int) bit : -1;
+}
+
+static int find_next_set_bit(const unsigned char* bitmap, uint32_t nbits, uint32_t start) {
+    // same as find_next_zero_bit() but looks for a bit in use, returns nbits if there is none
+    if (start >= nbits) {
+        return nbits;
+    }
+    uint32_t nwords = (nbits + 63) / 64;
+    uint32_t word_idx = start / 64;
+
+    uint64_t used_bits = load_bitmap_word(bitmap, word_idx) & (~0ULL << (start % 64));
+    while (used_bits == 0) {
+        word_idx++;
+        if (word_idx >= nwords) {
+            return nbits;
         }
+        used_bits = load_bitmap_word(bitmap, word_idx);
     }
-    normalized_path[normalized_len] = '\0';
-    return normalized_path;
 
+    uint32_t bit = word_idx * 64 + __builtin_ctzll(used_bits);
+    return bit < nbits ? (int) bit : (int) nbits;
 }
 
 bool is_inode_in_use(int inode_num) {
     // check if there exists a reserved inode with number inode_num
 
-    if (inode_num == 0) return false;
-    int byte_idx = (inode_num - 1) / 8;
-    int bit_idx = (inode_num - 1) % 8;
-    return (inode_bitmap[byte_idx] >> bit_idx) & 1;
+    if (inode_num == 0) return false;
+    return test_bitmap_bit(group_inode_bitmap(inode_group(inode_num)), (inode_num - 1) % sb->s_inodes_per_group);
+}
+
+// Blocks the scrubber is zeroing (see start_scrubber()) are reserved in memory, one bit per
+// block laid out like the group block bitmaps, and never in the on-disk bitmaps. Block
+// allocators skip reserved blocks, and give a block back when its reservation showed up while
+// they claimed it. Each side sets its own bit, then checks the other one behind a full fence,
+// so at least one of them always sees the other and backs off. An allocation that finds no
+// block while reservations are held waits for the scrubber to drop them before it gives up.
+static uint64_t* block_reservations = NULL;     // NULL while there is no scrubber
+static uint32_t reservation_words_per_group = 0;
+static uint32_t reserved_block_count = 0;       // bits set in block_reservations
+
+static bool wait_for_reserved_blocks();
+
+static unsigned char* group_block_reservations(uint32_t group) {
+    if (block_reservations == NULL) {
+        return NULL;
+    }
+    return (unsigned char*) (block_reservations + (size_t) group * reservation_words_per_group);
+}
+
+static bool any_bit_reserved(const unsigned char* reserved, uint32_t start, uint32_t len) {
+    // check bits [start, start + len) of a reservation map after claiming them in the bitmap
+    if (reserved == NULL) {
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return find_next_set_bit(reserved, start + len, start) < (int) (start + len);
+}
+
+static int find_next_unreserved_zero_bit(const unsigned char* bitmap, const unsigned char* reserved,
+                                         uint32_t nbits, uint32_t start) {
+    // first bit in [start, nbits) that is clear in bitmap and not reserved, -1 if there is none
+    while (true) {
+        int bit = find_next_zero_bit(bitmap, nbits, start);
+        if (bit == -1 || reserved == NULL || !test_bitmap_bit(reserved, bit)) {
+            return bit;
+        }
+        int unreserved = find_next_zero_bit(reserved, nbits, bit);
+        if (unreserved == -1) {
+            return -1;
+        }
+        start = unreserved;
+    }
+}
+
+static uint32_t alloc_zone_start(uint32_t first, uint32_t nbits) {
+    // starting bit of the calling thread's zone in [first, nbits)
+    if (alloc_thread_idx == -1) {
+        alloc_thread_idx = __atomic_fetch_add(&alloc_next_thread_idx, 1, __ATOMIC_RELAXED);
+    }
+    uint32_t zone_bits = ((nbits - first) / ALLOC_ZONES) & ~(ALLOC_ZONE_ALIGN_BITS - 1);
+    // small bitmaps fit in a few cachelines, every thread just starts at the beginning
+    return first + (alloc_thread_idx % ALLOC_ZONES) * zone_bits;
+}
+
+static int claim_free_bit(unsigned char* bitmap, const unsigned char* reserved, uint32_t nbits, uint32_t start) {
+    // atomically claim the first clear bit in [start, nbits) that is not reserved (reserved may
+    // be NULL), -1 if there is none
+    while (true) {
+        int bit = find_next_unreserved_zero_bit(bitmap, reserved, nbits, start);
+        if (bit == -1) {
+            return -1;
+        }
+        uint64_t mask = 1ULL << (bit % 64);
+        uint64_t old_word = __atomic_fetch_or((uint64_t*) bitmap + bit / 64, mask, __ATOMIC_ACQUIRE);
+        if (!(old_word & mask)) {
+            if (any_bit_reserved(reserved, bit, 1)) {
+                // the scrubber reserved it meanwhile and may be zeroing it, leave it alone
+                __atomic_fetch_and((uint64_t*) bitmap + bit / 64, ~mask, __ATOMIC_RELEASE);
+                start = bit + 1;
+                continue;
+            }
+            mark_bits_dirty((uint64_t*) bitmap + bit / 64, mask, true);
+            return bit; // the bit was clear, so this thread owns it now
+        }
+        // another thread claimed it first, keep looking after it
+        start = bit + 1;
+    }
+}
+
+static bool claim_bit_range(unsigned char* bitmap, const unsigned char* reserved, uint32_t start, uint32_t len) {
+    // atomically set bits [start, start + len) if all of them are still clear and none is
+    // reserved (reserved may be NULL), one compare-and-swap per word, rolling back the words
+    // already claimed on conflict
+    uint32_t end = start + len;
+    uint32_t bit = start;
+    while (bit < end) {
+        uint32_t offset = bit % 64;
+        uint32_t count = (end - bit < 64 - offset) ? end - bit : 64 - offset;
+        uint64_t mask = (count == 64) ? ~0ULL : ((1ULL << count) - 1) << offset;
+        uint64_t* word = (uint64_t*) bitmap + bit / 64;
+        uint64_t old_word = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            if (old_word & mask) {
+                // lost the race for part of the range
+                for (uint32_t undo = start; undo < bit; undo++) {
+                    clear_bitmap_bit(bitmap, undo);
+                }
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(word, &old_word, old_word | mask, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+        mark_bits_dirty(word, mask, true);
+        bit += count;
+    }
+    if (any_bit_reserved(reserved, start, len)) {
+        // the scrubber reserved part of the range meanwhile
+        for (uint32_t undo = start; undo < end; undo++) {
+            clear_bitmap_bit(bitmap, undo);
+        }
+        return false;
+    }
+    return true;
+}
+
+static int allocate_bit(unsigned char* bitmap, const unsigned char* reserved, uint32_t first, uint32_t nbits,
+                        uint32_t group, struct alloc_cursor* cursor) {
+    // claim the first clear bit in [first, nbits) of a bitmap of group that is not reserved,
+    // starting at the cursor when it points into this group, wrapping around once
+    uint32_t start = cursor->bit;
+    if (cursor->group != group || start < first || start >= nbits) {
+        start = alloc_zone_start(first, nbits);
+    }
+    int bit = claim_free_bit(bitmap, reserved, nbits, start);
+    if (bit == -1 && start > first) {
+        bit = claim_free_bit(bitmap, reserved, start, first);
+    }
+    if (bit == -1) {
+        return -1;
+    }
+
+    cursor->group = group;
+    cursor->bit = bit + 1;
+    return bit;
+}
+
+// Free block/inode counts live in the super block and the group descriptors, cachelines every
+// allocating thread would otherwise write to. Instead each thread accumulates its changes per
+// group in a private delta that is folded into both structures at the end of each of its
+// operations (commit_op()), within an operation once FREE_COUNT_BATCH changes are pending (e.g.
+// a large cp), and at sync points (sync_free_counts()). The image therefore never depends on
+// ext2_fsal_destroy() for its counts. read_free_*_count() give the exact value at any time.
+// The per-group values in the descriptors are only used as placement hints.
+enum free_count_kind {
+    FREE_BLOCKS,
+    FREE_INODES,
+    USED_DIRS,
+    FREE_COUNT_KINDS
+};
+
+struct free_count_deltas {
+    int* counts;        // FREE_COUNT_KINDS entries per group
+    uint32_t groups;    // number of groups counts is sized for
+    int pending;        // changes since the last fold
+    struct free_count_deltas* next;
+};
+
+#define FREE_COUNT_BATCH 64
+
+// guards the list of per-thread deltas, folding and exact reads; statically initialized because
+// threads may exit (and fold their deltas) after ext2_fsal_destroy()
+static pthread_mutex_t free_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct free_count_deltas* all_free_count_deltas = NULL;
+static bool free_counts_live = false;
+static pthread_key_t free_count_deltas_key;
+static pthread_once_t free_count_deltas_key_once = PTHREAD_ONCE_INIT;
+static __thread struct free_count_deltas* thread_free_count_deltas = NULL;
+
+static void apply_free_counts_locked(int* counts, uint32_t first_group, uint32_t groups) {
+    // move per-group deltas (counts[0] belongs to first_group) into the group descriptors and
+    // their sums into the super block; the fields are updated atomically because the placement
+    // heuristics read them without a lock
+    int blocks = 0;
+    int inodes = 0;
+
+    // the group descriptors and the super block are locked one at a time, never nested
+    pthread_mutex_lock(&group_desc_lock);
+    for (uint32_t i = 0; i < groups && first_group + i < group_count; i++) {
+        int* group_counts = &counts[i * FREE_COUNT_KINDS];
+        uint32_t group = first_group + i;
+        int free_blocks = __atomic_exchange_n(&group_counts[FREE_BLOCKS], 0, __ATOMIC_RELAXED);
+        int free_inodes = __atomic_exchange_n(&group_counts[FREE_INODES], 0, __ATOMIC_RELAXED);
+        int used_dirs = __atomic_exchange_n(&group_counts[USED_DIRS], 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&gd[group].bg_free_blocks_count, free_blocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&gd[group].bg_free_inodes_count, free_inodes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&gd[group].bg_used_dirs_count, used_dirs, __ATOMIC_RELAXED);
+        blocks += free_blocks;
+        inodes += free_inodes;
+    }
+    pthread_mutex_unlock(&group_desc_lock);
+
+    pthread_mutex_lock(&superblock_lock);
+    __atomic_fetch_add(&sb->s_free_blocks_count, blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sb->s_free_inodes_count, inodes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&superblock_lock);
+}
+
+static void fold_free_count_deltas_locked(struct free_count_deltas* deltas) {
+    // move the pending deltas of one thread into the group descriptors and super block
+    if (__atomic_exchange_n(&deltas->pending, 0, __ATOMIC_RELAXED) != 0) {
+        apply_free_counts_locked(deltas->counts, 0, deltas->groups);
+    }
+}
+
+static void release_thread_free_count_deltas(void* arg) {
+    // thread exit: hand the remaining deltas over and drop the thread from the list
+    struct free_count_deltas* deltas = arg;
+    pthread_mutex_lock(&free_counts_lock);
+    if (free_counts_live) {
+        fold_free_count_deltas_locked(deltas);
+    }
+    for (struct free_count_deltas** link = &all_free_count_deltas; *link != NULL; link = &(*link)->next) {
+        if (*link == deltas) {
+            *link = deltas->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&free_counts_lock);
+    free(deltas->counts);
+    free(deltas);
+}
+
+static void create_free_count_deltas_key() {
+    pthread_key_create(&free_count_deltas_key, release_thread_free_count_deltas);
+}
+
+static struct free_count_deltas* get_thread_free_count_deltas() {
+    // deltas of the calling thread, created on first use, NULL if out of memory
+    struct free_count_deltas* deltas = thread_free_count_deltas;
+    if (deltas == NULL) {
+        pthread_once(&free_count_deltas_key_once, create_free_count_deltas_key);
+        deltas = calloc(1, sizeof(struct free_count_deltas));
+        if (deltas == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&free_counts_lock);
+        deltas->next = all_free_count_deltas;
+        all_free_count_deltas = deltas;
+        pthread_mutex_unlock(&free_counts_lock);
+        pthread_setspecific(free_count_deltas_key, deltas);
+        thread_free_count_deltas = deltas;
+    }
+
+    if (deltas->groups != group_count) {
+        // first use, or the thread outlived an image with a different number of groups;
+        // everything was folded when that image was destroyed
+        pthread_mutex_lock(&free_counts_lock);
+        int* counts = calloc(group_count * FREE_COUNT_KINDS, sizeof(int));
+        if (counts != NULL) {
+            free(deltas->counts);
+            deltas->counts = counts;
+            deltas->groups = group_count;
+        }
+        pthread_mutex_unlock(&free_counts_lock);
+        if (counts == NULL) {
+            return NULL;
+        }
+    }
+    return deltas;
+}
+
+static void adjust_free_counts(uint32_t group, enum free_count_kind kind, int delta) {
+    struct free_count_deltas* deltas = get_thread_free_count_deltas();
+    if (deltas == NULL) {
+        // no private deltas for this thread, apply the change right away
+        int counts[FREE_COUNT_KINDS] = { 0 };
+        counts[kind] = delta;
+        pthread_mutex_lock(&free_counts_lock);
+        apply_free_counts_locked(counts, group, 1);
+        pthread_mutex_unlock(&free_counts_lock);
+        return;
+    }
+
+    // only this thread adds to its deltas, the atomics just keep folds from other threads exact
+    __atomic_add_fetch(&deltas->counts[group * FREE_COUNT_KINDS + kind], delta, __ATOMIC_RELAXED);
+    int pending = __atomic_add_fetch(&deltas->pending, abs(delta), __ATOMIC_RELAXED);
+    if (pending >= FREE_COUNT_BATCH) {
+        pthread_mutex_lock(&free_counts_lock);
+        fold_free_count_deltas_locked(deltas);
+        pthread_mutex_unlock(&free_counts_lock);
+    }
+}
+
+static void fold_thread_free_counts() {
+    // end of an operation: the counts it changed reach the image now, not at a later sync point
+    struct free_count_deltas* deltas = thread_free_count_deltas;
+    if (deltas != NULL && __atomic_load_n(&deltas->pending, __ATOMIC_RELAXED) != 0) {
+        pthread_mutex_lock(&free_counts_lock);
+        fold_free_count_deltas_locked(deltas);
+        pthread_mutex_unlock(&free_counts_lock);
+    }
+}
+
+void init_free_counts() {
+    pthread_mutex_lock(&free_counts_lock);
+    free_counts_live = true;
+    pthread_mutex_unlock(&free_counts_lock);
+}
+
+void sync_free_counts() {
+    // fold the pending deltas of every thread, so the on-disk counts are exact
+    pthread_mutex_lock(&free_counts_lock);
+    for (struct free_count_deltas* deltas = all_free_count_deltas; deltas != NULL; deltas = deltas->next) {
+        fold_free_count_deltas_locked(deltas);
+    }
+    pthread_mutex_unlock(&free_counts_lock);
+}
+
+void destroy_free_counts() {
+    // final sync, threads exiting after this only release their deltas
+    sync_free_counts();
+    pthread_mutex_lock(&free_counts_lock);
+    free_counts_live = false;
+    pthread_mutex_unlock(&free_counts_lock);
+}
+
+static uint32_t count_set_bits(const unsigned char* bitmap, uint32_t nbits) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < nbits / 64; i++) {
+        count += __builtin_popcountll(load_bitmap_word(bitmap, i));
+    }
+    if (nbits % 64 != 0) {
+        count += __builtin_popcountll(load_bitmap_word(bitmap, nbits / 64) & ((1ULL << (nbits % 64)) - 1));
+    }
+    return count;
+}
+
+static int compare_blocks(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_journal_records(const void* a, const void* b) {
+    struct journal_record x;
+    struct journal_record y;
+    memcpy(&x, *(const unsigned char* const*) a, sizeof(x));
+    memcpy(&y, *(const unsigned char* const*) b, sizeof(y));
+    return (x.seq > y.seq) - (x.seq < y.seq);
+}
+
+static void recount_groups(uint32_t* bitmap_blocks, uint32_t count) {
+    // recompute the counters of the groups whose bitmaps were replayed (bitmap_blocks, sorted),
+    // the batched counters of the crashed run may never have reached the image
+    for (uint32_t group = 0; group < group_count; group++) {
+        if (bsearch(&gd[group].bg_block_bitmap, bitmap_blocks, count, sizeof(uint32_t), compare_blocks) != NULL) {
+            gd[group].bg_free_blocks_count = group_block_count(group) - count_set_bits(group_block_bitmap(group), group_block_count(group));
+        }
+        if (bsearch(&gd[group].bg_inode_bitmap, bitmap_blocks, count, sizeof(uint32_t), compare_blocks) != NULL) {
+            const unsigned char* bitmap = group_inode_bitmap(group);
+            gd[group].bg_free_inodes_count = sb->s_inodes_per_group - count_set_bits(bitmap, sb->s_inodes_per_group);
+            uint32_t dirs = 0;
+            for (uint32_t bit = find_next_set_bit(bitmap, sb->s_inodes_per_group, 0); bit < sb->s_inodes_per_group;
+                 bit = find_next_set_bit(bitmap, sb->s_inodes_per_group, bit + 1)) {
+                if ((get_inode(group * sb->s_inodes_per_group + bit + 1)->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+                    dirs++;
+                }
+            }
+            gd[group].bg_used_dirs_count = dirs;
+        }
+    }
+
+    uint32_t free_blocks = 0;
+    uint32_t free_inodes = 0;
+    for (uint32_t group = 0; group < group_count; group++) {
+        free_blocks += gd[group].bg_free_blocks_count;
+        free_inodes += gd[group].bg_free_inodes_count;
+    }
+    sb->s_free_blocks_count = free_blocks;
+    sb->s_free_inodes_count = free_inodes;
+}
+
+static int replay_journal(int fd) {
+    /* Return value interpretation:
+     * -1 -> the journal could not be read
+     * otherwise -> number of transactions replayed
+     *
+     * Transactions are read up to the first incomplete or corrupt one (the tail of a write
+     * cut short by the crash); their records are applied in sequence order. The cost is one
+     * pass over the journal plus a recount of the groups whose bitmaps changed.
+     */
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        return 0;
+    }
+
+    unsigned char* log = malloc(size);
+    // every record takes at least a record header
+    const unsigned char** records = malloc((size / sizeof(struct journal_record) + 1) * sizeof(unsigned char*));
+    uint32_t* bitmap_blocks = malloc((size / sizeof(struct journal_record) + 1) * sizeof(uint32_t));
+    if (log == NULL || records == NULL || bitmap_blocks == NULL) {
+        perror("malloc");
+        free(log);
+        free(records);
+        free(bitmap_blocks);
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = pread(fd, log + done, size - done, done);
+        if (res <= 0) {
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("journal");
+            free(log);
+            free(records);
+            free(bitmap_blocks);
+            return -1;
+        }
+        done += res;
+    }
+
+    int txns = 0;
+    uint32_t count = 0;
+    uint32_t revokes = 0;
+    uint32_t revoke_groups = 0;
+    size_t pos = 0;
+    while (size - pos >= sizeof(struct journal_txn_header)) {
+        struct journal_txn_header header;
+        memcpy(&header, log + pos, sizeof(header));
+        const unsigned char* data = log + pos + sizeof(header);
+        if (header.magic != JOURNAL_MAGIC || header.len > size - pos - sizeof(header)
+            || journal_checksum(&header, data) != header.checksum) {
+            break;
+        }
+
+        // a transaction is applied whole or not at all
+        uint32_t first = count;
+        size_t offset = 0;
+        bool valid = true;
+        for (uint32_t i = 0; i < header.records && valid; i++) {
+            struct journal_record record;
+            valid = header.len - offset >= sizeof(record);
+            if (valid) {
+                memcpy(&record, data + offset, sizeof(record));
+                valid = record.len <= header.len - offset - sizeof(record)
+                        && record.offset <= disk_size && record.len <= disk_size - record.offset
+                        && (record.type == JOURNAL_BYTES
+                            || ((record.type == JOURNAL_SET_BITS || record.type == JOURNAL_CLEAR_BITS)
+                                && record.len == sizeof(uint64_t) && record.offset % sizeof(uint64_t) == 0)
+                            || (record.type == JOURNAL_REVOKE && record.len == sizeof(uint32_t)
+                                && record.offset % EXT2_BLOCK_SIZE == 0));
+                if (valid && record.type == JOURNAL_REVOKE) {
+                    uint32_t blocks;
+                    memcpy(&blocks, data + offset + sizeof(record), sizeof(blocks));
+                    valid = blocks > 0 && record.offset / EXT2_BLOCK_SIZE >= sb->s_first_data_block
+                            && blocks <= (disk_size - record.offset) / EXT2_BLOCK_SIZE;
+                    if (valid) {
+                        // the bitmap of every group the blocks are in gets recounted
+                        uint32_t first = record.offset / EXT2_BLOCK_SIZE;
+                        revoke_groups += block_group(first + blocks - 1) - block_group(first) + 1;
+                    }
+                    revokes++;
+                }
+            }
+            if (valid) {
+                records[count++] = data + offset;
+                offset += sizeof(record) + record.len;
+            }
+        }
+        if (!valid || offset != header.len) {
+            count = first;
+            break;
+        }
+        txns++;
+        pos += sizeof(header) + header.len;
+    }
+
+    qsort(records, count, sizeof(unsigned char*), compare_journal_records);
+    if (revoke_groups > 0) {
+        uint32_t* grown = realloc(bitmap_blocks, (count + revoke_groups) * sizeof(uint32_t));
+        if (grown == NULL) {
+            perror("malloc");
+            free(log);
+            free(records);
+            free(bitmap_blocks);
+            return -1;
+        }
+        bitmap_blocks = grown;
+    }
+
+    // for each block, 1 + the sequence number of the last revoke of it (0: never revoked)
+    size_t nblocks = disk_size / EXT2_BLOCK_SIZE;
+    uint64_t* revoked = (revokes > 0) ? calloc(nblocks, sizeof(uint64_t)) : NULL;
+    if (revokes > 0 && revoked == NULL) {
+        perror("malloc");
+        free(log);
+        free(records);
+        free(bitmap_blocks);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count && revoked != NULL; i++) {
+        struct journal_record record;
+        memcpy(&record, records[i], sizeof(record));
+        if (record.type == JOURNAL_REVOKE) {
+            uint32_t blocks;
+            memcpy(&blocks, records[i] + sizeof(record), sizeof(blocks));
+            for (size_t block = record.offset / EXT2_BLOCK_SIZE; block < record.offset / EXT2_BLOCK_SIZE + blocks; block++) {
+                revoked[block] = record.seq + 1;
+            }
+        }
+    }
+
+    uint32_t nbitmaps = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct journal_record record;
+        memcpy(&record, records[i], sizeof(record));
+        const unsigned char* data = records[i] + sizeof(record);
+        if (record.type == JOURNAL_REVOKE) {
+            // the blocks were freed
+            uint32_t blocks;
+            memcpy(&blocks, data, sizeof(blocks));
+            for (uint32_t block = record.offset / EXT2_BLOCK_SIZE; block < record.offset / EXT2_BLOCK_SIZE + blocks; block++) {
+                uint32_t group = block_group(block);
+                uint32_t bit = (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+                uint64_t* word = (uint64_t*) group_block_bitmap(group) + bit / 64;
+                *word &= ~(1ULL << (bit % 64));
+                if (nbitmaps == 0 || bitmap_blocks[nbitmaps - 1] != gd[group].bg_block_bitmap) {
+                    bitmap_blocks[nbitmaps++] = gd[group].bg_block_bitmap;
+                    mark_journaled((size_t) gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+                }
+            }
+            continue;
+        }
+        if (record.type == JOURNAL_BYTES) {
+            // block by block, leaving out the blocks freed after the record was logged
+            size_t done = 0;
+            while (done < record.len) {
+                size_t block = (record.offset + done) / EXT2_BLOCK_SIZE;
+                size_t chunk = EXT2_BLOCK_SIZE - (record.offset + done) % EXT2_BLOCK_SIZE;
+                if (chunk > record.len - done) {
+                    chunk = record.len - done;
+                }
+                if (revoked == NULL || revoked[block] <= record.seq + 1) {
+                    memcpy(disk + record.offset + done, data + done, chunk);
+                    mark_journaled(record.offset + done, chunk);
+                }
+                done += chunk;
+            }
+            continue;
+        }
+        uint64_t mask;
+        memcpy(&mask, data, sizeof(mask));
+        uint64_t* word = (uint64_t*) (disk + record.offset);
+        *word = (record.type == JOURNAL_SET_BITS) ? (*word | mask) : (*word & ~mask);
+        bitmap_blocks[nbitmaps++] = record.offset / EXT2_BLOCK_SIZE;
+        mark_journaled(record.offset, sizeof(mask));
+    }
+    qsort(bitmap_blocks, nbitmaps, sizeof(uint32_t), compare_blocks);
+    recount_groups(bitmap_blocks, nbitmaps);
+
+    free(revoked);
+    free(log);
+    free(records);
+    free(bitmap_blocks);
+    return txns;
+}
+
+bool open_journal(const char* path, bool enable) {
+    /* Return value interpretation:
+     * false -> the journal exists but could not be replayed, or could not be created
+     * true -> any committed transactions left by an earlier run are in the image, and
+     *         journaling is on if enable is set
+     *
+     * Called by ext2_fsal_init() before any operation runs.
+     */
+    int fd = open(path, O_RDWR | (enable ? O_CREAT : 0), 0644);
+    if (fd == -1) {
+        if (!enable && errno == ENOENT) {
+            return true;
+        }
+        perror(path);
+        return false;
+    }
+
+    // with the journal on, the image is mapped privately and written back block by block
+    if (image_private) {
+        journal_dirty_blocks = calloc((disk_size / EXT2_BLOCK_SIZE + 63) / 64, sizeof(uint64_t));
+        if (journal_dirty_blocks == NULL) {
+            perror("malloc");
+            close(fd);
+            return false;
+        }
+    }
+
+    int txns = replay_journal(fd);
+    if (txns == -1) {
+        close(fd);
+        return false;
+    }
+
+    // the replayed changes go to the image before the journal is emptied
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        if (!write_back_image() || ftruncate(fd, 0) == -1 || fsync(fd) == -1) {
+            perror(path);
+            close(fd);
+            return false;
+        }
+    }
+
+    if (!enable) {
+        close(fd);
+        unlink(path);
+        return true;
+    }
+    journal_fd = fd;
+    journal_size = 0;
+    journal_next_seq = 0;
+    written_tid = 0;
+    synced_tid = 0;
+    running_tid = 1;
+    return true;
+}
+
+void close_journal() {
+    // commit what is left and checkpoint, the image is complete without the journal afterwards;
+    // called once no operation runs any more
+    if (journal_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&journal_flush_lock);
+    commit_running_locked(false, true);
+    close(journal_fd);
+    journal_fd = -1;
+    pthread_mutex_unlock(&journal_flush_lock);
+    free(journal_dirty_blocks);
+    journal_dirty_blocks = NULL;
+}
+
+static uint32_t read_free_count(enum free_count_kind kind, const uint32_t* folded) {
+    // exact count, including deltas not folded yet
+    pthread_mutex_lock(&free_counts_lock);
+    int64_t count = __atomic_load_n(folded, __ATOMIC_RELAXED);
+    for (struct free_count_deltas* deltas = all_free_count_deltas; deltas != NULL; deltas = deltas->next) {
+        for (uint32_t group = 0; group < deltas->groups; group++) {
+            count += __atomic_load_n(&deltas->counts[group * FREE_COUNT_KINDS + kind], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&free_counts_lock);
+    return count;
+}
+
+uint32_t read_free_blocks_count() {
+    return read_free_count(FREE_BLOCKS, &sb->s_free_blocks_count);
+}
+
+uint32_t read_free_inodes_count() {
+    return read_free_count(FREE_INODES, &sb->s_free_inodes_count);
+}
+
+static int64_t group_count_hint(uint32_t group, enum free_count_kind kind, const unsigned short* folded) {
+    // folded value plus the calling thread's own pending delta, so a thread sees its
+    // allocations right away; other threads' deltas show up when they are folded
+    int64_t count = __atomic_load_n(folded, __ATOMIC_RELAXED);
+    struct free_count_deltas* deltas = thread_free_count_deltas;
+    if (deltas != NULL && group < deltas->groups) {
+        count += __atomic_load_n(&deltas->counts[group * FREE_COUNT_KINDS + kind], __ATOMIC_RELAXED);
+    }
+    return count > 0 ? count : 0;
+}
+
+static uint32_t group_free_inodes(uint32_t group) {
+    return group_count_hint(group, FREE_INODES, &gd[group].bg_free_inodes_count);
+}
+
+static uint32_t group_free_blocks(uint32_t group) {
+    return group_count_hint(group, FREE_BLOCKS, &gd[group].bg_free_blocks_count);
+}
+
+static uint32_t group_used_dirs(uint32_t group) {
+    return group_count_hint(group, USED_DIRS, &gd[group].bg_used_dirs_count);
+}
+
+// rotates the first group considered for top level directories
+static uint32_t dir_spread_next = 0;
+
+static uint32_t find_group_for_dir(uint32_t parent_group, bool top_level) {
+    // Orlov-style placement: top level directories are spread over the groups with the most
+    // room, deeper directories stay near their parent unless that group is getting crowded
+    uint32_t avg_free_inodes = __atomic_load_n(&sb->s_free_inodes_count, __ATOMIC_RELAXED) / group_count;
+    uint32_t avg_free_blocks = __atomic_load_n(&sb->s_free_blocks_count, __ATOMIC_RELAXED) / group_count;
+
+    if (top_level) {
+        // least used group among those with at least average free space
+        uint32_t start = __atomic_fetch_add(&dir_spread_next, 1, __ATOMIC_RELAXED) % group_count;
+        int best_group = -1;
+        uint32_t best_dirs = UINT32_MAX;
+        for (uint32_t i = 0; i < group_count; i++) {
+            uint32_t group = (start + i) % group_count;
+            uint32_t free_inodes = group_free_inodes(group);
+            if (free_inodes == 0 || free_inodes < avg_free_inodes
+                || group_free_blocks(group) < avg_free_blocks) {
+                continue;
+            }
+            if (group_used_dirs(group) < best_dirs) {
+                best_group = group;
+                best_dirs = group_used_dirs(group);
+            }
+        }
+        if (best_group != -1) {
+            return best_group;
+        }
+    }
+    else {
+        // first group from the parent's on that is neither full of directories nor short on space
+        uint32_t dirs = 0;
+        for (uint32_t group = 0; group < group_count; group++) {
+            dirs += group_used_dirs(group);
+        }
+        uint32_t max_dirs = dirs / group_count + sb->s_inodes_per_group / 16;
+        uint32_t min_inodes = avg_free_inodes > sb->s_inodes_per_group / 4 ? avg_free_inodes - sb->s_inodes_per_group / 4 : 1;
+        uint32_t min_blocks = avg_free_blocks > sb->s_blocks_per_group / 4 ? avg_free_blocks - sb->s_blocks_per_group / 4 : 0;
+        for (uint32_t i = 0; i < group_count; i++) {
+            uint32_t group = (parent_group + i) % group_count;
+            if (group_used_dirs(group) < max_dirs && group_free_inodes(group) >= min_inodes
+                && group_free_blocks(group) >= min_blocks) {
+                return group;
+            }
+        }
+    }
+
+    // fall back to the first group with a free inode
+    for (uint32_t i = 0; i < group_count; i++) {
+        uint32_t group = (parent_group + i) % group_count;
+        if (group_free_inodes(group) > 0) {
+            return group;
+        }
+    }
+    return parent_group;
+}
+
+static uint32_t find_group_for_file(uint32_t parent_group) {
+    // keep files in the group of their directory so data and metadata stay close
+    if (group_free_inodes(parent_group) > 0 && group_free_blocks(parent_group) > 0) {
+        return parent_group;
+    }
+
+    // quadratic probing away from the parent, as ext2 does, then a linear scan
+    uint32_t group = parent_group;
+    for (uint32_t i = 1; i < group_count; i <<= 1) {
+        group = (group + i) % group_count;
+        if (group_free_inodes(group) > 0 && group_free_blocks(group) > 0) {
+            return group;
+        }
+    }
+    for (uint32_t i = 1; i < group_count; i++) {
+        group = (parent_group + i) % group_count;
+        if (group_free_inodes(group) > 0) {
+            return group;
+        }
+    }
+    return parent_group;
+}
+
+int find_free_inode(int parent_inode_num, bool is_dir) {
+    uint32_t parent_group = inode_group(parent_inode_num);
+    uint32_t goal = is_dir ? find_group_for_dir(parent_group, parent_inode_num == EXT2_ROOT_INO)
+                           : find_group_for_file(parent_group);
+
+    // group counts are only hints, so every group is tried starting at the chosen one
+    for (uint32_t i = 0; i < group_count; i++) {
+        uint32_t group = (goal + i) % group_count;
+        int bit = allocate_bit(group_inode_bitmap(group), NULL, group_first_free_ino_bit(group),
+                               sb->s_inodes_per_group, group, &inode_alloc_cursor);
+        if (bit == -1) {
+            continue;
+        }
+        adjust_free_counts(group, FREE_INODES, -1);
+        if (is_dir) {
+            adjust_free_counts(group, USED_DIRS, 1);
+        }
+
+        // inode number starts at 1
+        return group * sb->s_inodes_per_group + bit + 1;
+    }
+    return -1;
+}
+
+int initialize_new_inode(int parent_inode_num, int mode) {
+    // allocate new inode of i_mode mode, placed relative to its parent directory
+    int new_inode_num = find_free_inode(parent_inode_num, mode == INODE_MODE_DIR);
+    if (new_inode_num == -1) {
+        return -1; // no space left
+    }
+    
+
+    struct ext2_inode* inode = get_inode(new_inode_num);
+    inode->i_links_count = 1;
+    inode->i_dtime = 0;
+    if (mode == INODE_MODE_FILE) {
+        inode->i_mode = EXT2_S_IFREG | 0644; 
+        inode->i_size = 0;
+        inode->i_blocks = 0;
+    } 
+    else if (mode == INODE_MODE_DIR) {
+        inode->i_mode = EXT2_S_IFDIR | 0755; // allow owners to read, write, exec while others can only read and exec
+        inode->i_size = EXT2_BLOCK_SIZE;
+        inode->i_blocks = EXT2_BLOCK_SIZE / 512; // i_blocks reflect actual disk sectors
+        inode->i_links_count = 2; // the entry in the parent and its own "."
+    } 
+    else {
+        // mode == INODE_MODE_LINK at this point
+        inode->i_mode = EXT2_S_IFLNK | 0777;
+        inode->i_size = 0;
+        inode->i_blocks = 0;
+    }
+    
+    
+    // initalize all block pointers to 0
+    memset(inode->i_block, 0, EXT2_N_BLOCKS * sizeof(unsigned int));
+    mark_inode_dirty(new_inode_num);
+    return new_inode_num;
+}
+
+int find_free_block(int goal_inode_num) {
+    // allocate a block in the group of goal_inode_num, or the next group with room
+    uint32_t goal = inode_group(goal_inode_num);
+    do {
+        for (uint32_t i = 0; i < group_count; i++) {
+            uint32_t group = (goal + i) % group_count;
+            int bit = allocate_bit(group_block_bitmap(group), group_block_reservations(group), 0, group_block_count(group),
+                                   group, &block_alloc_cursor);
+            if (bit == -1) {
+                continue;
+            }
+            adjust_free_counts(group, FREE_BLOCKS, -1);
+
+            // bit i of a block bitmap describes block i of the group
+            return sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+        }
+    } while (wait_for_reserved_blocks());
+    return -1;
+}
+
+static int claim_block_run_in_group(uint32_t group, int wanted, int* run_len) {
+    // first-fit search for wanted free blocks in one group, see find_free_block_run()
+    unsigned char* bitmap = group_block_bitmap(group);
+    const unsigned char* reserved = group_block_reservations(group);
+    uint32_t nbits = group_block_count(group);
+    uint32_t start = block_alloc_cursor.bit;
+    if (block_alloc_cursor.group != group || start >= nbits) {
+        start = alloc_zone_start(0, nbits);
+    }
+    int best_bit;
+    int best_len;
+
+    do {
+        best_bit = -1;
+        best_len = 0;
+
+        // two passes: [start, nbits) then [0, start)
+        for (int pass = 0; pass < 2 && best_len < wanted; pass++) {
+            uint32_t lo = (pass == 0) ? start : 0;
+            uint32_t hi = (pass == 0) ? nbits : start;
+            int bit = find_next_unreserved_zero_bit(bitmap, reserved, hi, lo);
+            while (bit != -1) {
+                int end = find_next_set_bit(bitmap, hi, bit);
+                if (reserved != NULL) {
+                    // a run also ends at the first block the scrubber holds
+                    end = find_next_set_bit(reserved, end, bit);
+                }
+                if (end - bit > best_len) {
+                    best_bit = bit;
+                    best_len = end - bit;
+                    if (best_len >= wanted) {
+                        best_len = wanted;
+                        break;
+                    }
+                }
+                bit = find_next_unreserved_zero_bit(bitmap, reserved, hi, end);
+            }
+        }
+
+        if (best_bit == -1) {
+            return -1;
+        }
+        // mark the whole run as in use, search again if another thread took part of it meanwhile
+    } while (!claim_bit_range(bitmap, reserved, best_bit, best_len));
+
+    block_alloc_cursor.group = group;
+    block_alloc_cursor.bit = best_bit + best_len;
+    adjust_free_counts(group, FREE_BLOCKS, -best_len);
+
+    *run_len = best_len;
+    return best_bit;
+}
+
+int find_free_block_run(int goal_inode_num, int wanted, int* run_len) {
+    /*
+    Allocate up to wanted contiguous blocks.
+    Return value interpretation:
+    -1: no free block left
+    other values: first block of the run, *run_len holds the number of blocks in it
+
+    Free runs are visited first-fit starting at the allocation cursor, in the group of
+    goal_inode_num first. When no run is long enough the longest one seen in that group
+    is handed out instead, and the caller asks again for the remainder. Runs never
+    cross a group boundary.
+    */
+    uint32_t goal = inode_group(goal_inode_num);
+    do {
+        for (uint32_t i = 0; i < group_count; i++) {
+            uint32_t group = (goal + i) % group_count;
+            int bit = claim_block_run_in_group(group, wanted, run_len);
+            if (bit != -1) {
+                return sb->s_first_data_block + group * sb->s_blocks_per_group + bit;
+            }
+        }
+    } while (wait_for_reserved_blocks());
+    return -1;
+}
+
+void release_block(int block_num) {
+    if (journal_fd != -1) {
+        // the block stays allocated until the transaction freeing it is committed, see
+        // release_revoked_blocks(); if the record is lost it stays allocated for good
+        journal_revoke(block_num);
+        return;
+    }
+    uint32_t group = block_group(block_num);
+    clear_bitmap_bit(group_block_bitmap(group), (block_num - sb->s_first_data_block) % sb->s_blocks_per_group);
+    adjust_free_counts(group, FREE_BLOCKS, 1);
+}
+
+static void release_revoked_blocks(const unsigned char* records, size_t len) {
+    // free the blocks of the revoke records of a committed transaction; their bits were logged
+    // by the revoke records, only the bitmaps in the mapping change here
+    size_t offset = 0;
+    while (offset < len) {
+        struct journal_record record;
+        memcpy(&record, records + offset, sizeof(record));
+        if (record.type == JOURNAL_REVOKE) {
+            uint32_t blocks;
+            memcpy(&blocks, records + offset + sizeof(record), sizeof(blocks));
+            for (uint32_t block = record.offset / EXT2_BLOCK_SIZE; block < record.offset / EXT2_BLOCK_SIZE + blocks; block++) {
+                uint32_t group = block_group(block);
+                uint32_t bit = (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+                __atomic_fetch_and((uint64_t*) group_block_bitmap(group) + bit / 64, ~(1ULL << (bit % 64)), __ATOMIC_RELEASE);
+                mark_journaled((size_t) gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+                adjust_free_counts(group, FREE_BLOCKS, 1);
+            }
+        }
+        offset += sizeof(record) + record.len;
+    }
+}
+
+void release_inode(int inode_num) {
+    // the inode number may come back as a different directory
+    dcache_forget_dir(inode_num);
+
+    uint32_t group = inode_group(inode_num);
+    if (is_inode_to_dir(inode_num)) {
+        adjust_free_counts(group, USED_DIRS, -1);
+    }
+    clear_bitmap_bit(group_inode_bitmap(group), (inode_num - 1) % sb->s_inodes_per_group);
+    adjust_free_counts(group, FREE_INODES, 1);
+}
+
+// number of block numbers in one indirect table
+#define PTRS_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(uint32_t))
+
+int take_supply_block(struct block_supply* supply) {
+    // next block of the supply, a new run is allocated once the current one is used up
+    if (supply->left == 0) {
+        int run_len;
+        int run_start = find_free_block_run(supply->goal_inode_num, supply->remaining > 0 ? supply->remaining : 1, &run_len);
+        if (run_start == -1) {
+            return -1;
+        }
+        supply->next = run_start;
+        supply->left = run_len;
+        // the whole run gets written, as data or as indirect tables; tables are metadata and
+        // are marked again once filled in, see mark_file_tables_dirty()
+        mark_data_dirty(run_start, run_len);
+    }
+    supply->left--;
+    if (supply->remaining > 0) {
+        supply->remaining--;
+    }
+    supply->taken++;
+    return supply->next++;
+}
+
+uint32_t count_file_blocks(uint32_t data_blocks) {
+    // data blocks plus the indirect tables needed to address them
+    uint32_t total = data_blocks;
+    if (data_blocks <= EXT2_NDIR_BLOCKS) {
+        return total;
+    }
+    uint32_t rest = data_blocks - EXT2_NDIR_BLOCKS;
+    total += 1; // single indirect table
+    if (rest <= PTRS_PER_BLOCK) {
+        return total;
+    }
+    rest -= PTRS_PER_BLOCK;
+    uint32_t double_span = PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    uint32_t double_rest = rest < double_span ? rest : double_span;
+    total += 1 + (double_rest + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK; // double table and its tables
+    if (rest <= double_span) {
+        return total;
+    }
+    rest -= double_span;
+    total += 1 + (rest + double_span - 1) / double_span + (rest + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+    return total;
+}
+
+uint32_t* get_block_slot(struct ext2_inode* inode, uint32_t idx, struct block_supply* supply) {
+    /*
+    Return value interpretation:
+    NULL: an indirect table on the way is missing (supply is NULL) or could not be allocated
+    other values: the i_block[] or indirect table entry holding logical block idx
+
+    Missing indirect tables are taken from supply and zeroed. Since a supply hands out blocks
+    in ascending order, each table lands right in front of the data blocks it points to.
+    */
+    if (idx < EXT2_NDIR_BLOCKS) {
+        return &inode->i_block[idx];
+    }
+    idx -= EXT2_NDIR_BLOCKS;
+
+    // pick the tree holding idx and the number of table levels below i_block[]
+    uint32_t* slot;
+    int depth;
+    uint32_t span;  // data blocks covered by one entry of the top table
+    if (idx < PTRS_PER_BLOCK) {
+        slot = &inode->i_block[EXT2_IND_BLOCK];
+        depth = 1;
+        span = 1;
+    }
+    else if ((idx -= PTRS_PER_BLOCK) < PTRS_PER_BLOCK * PTRS_PER_BLOCK) {
+        slot = &inode->i_block[EXT2_DIND_BLOCK];
+        depth = 2;
+        span = PTRS_PER_BLOCK;
+    }
+    else {
+        idx -= PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+        slot = &inode->i_block[EXT2_TIND_BLOCK];
+        depth = 3;
+        span = PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    }
+
+    for (; depth > 0; depth--, span /= PTRS_PER_BLOCK) {
+        if (*slot == 0) {
+            if (supply == NULL) {
+                return NULL;
+            }
+            int table_block = take_supply_block(supply);
+            if (table_block == -1) {
+                return NULL;
+            }
+            memset(disk + (size_t) table_block * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
+            *slot = table_block;
+        }
+        uint32_t* table = (uint32_t*) (disk + (size_t) *slot * EXT2_BLOCK_SIZE);
+        slot = &table[idx / span];
+        idx %= span;
+    }
+    return slot;
+}
+
+uint32_t get_file_block(struct ext2_inode* inode, uint32_t idx) {
+    // block number of logical block idx, 0 for a hole
+    uint32_t* slot = get_block_slot(inode, idx, NULL);
+    return slot == NULL ? 0 : *slot;
+}
+
+static void mark_table_tree_dirty(uint32_t block_num, int depth) {
+    // mark an indirect table (depth >= 1) and the tables below it
+    if (block_num == 0 || depth == 0) {
+        return;
+    }
+    if (depth > 1) {
+        uint32_t* table = (uint32_t*) (disk + (size_t) block_num * EXT2_BLOCK_SIZE);
+        for (uint32_t i = 0; i < PTRS_PER_BLOCK; i++) {
+            mark_table_tree_dirty(table[i], depth - 1);
+        }
+    }
+    mark_blocks_dirty(block_num, 1);
+}
+
+void mark_file_tables_dirty(struct ext2_inode* inode) {
+    // mark the indirect tables of a file whose block map is complete
+    for (int i = EXT2_IND_BLOCK; i < EXT2_N_BLOCKS; i++) {
+        mark_table_tree_dirty(inode->i_block[i], i - EXT2_NDIR_BLOCKS + 1);
+    }
+}
+
+// Lazy zeroing (start_scrubber()): freed blocks are only cleared in the bitmap and queued as
+// dirty-free runs, instead of being overwritten with zeros on the spot, which dirtied every
+// page of the old content of an overwritten file. A scrubber thread at idle priority zeroes
+// the queued blocks later, punching holes into the image file where it can, and keeps a small
+// pool of zeroed blocks for directory blocks (see find_zeroed_block()). While it zeroes a run
+// the scrubber holds the run in the in-memory reservation map the block allocators check, so a
+// block cannot be handed out half zeroed; blocks allocated again before the scrubber got to
+// them are skipped. The bitmaps in the image are never touched, so there is nothing to journal
+// and nothing a crash can leave behind.
+// No allocation relies on freed blocks being zero: tables, directory and symlink blocks are
+// zeroed when allocated and cp zeroes the tail of a file's last block, so a queue that
+// overflows or is dropped at exit only leaves old data in free blocks.
+#define SCRUB_QUEUE_MAX (1024 * 1024)   // queued runs beyond this are not zeroed
+#define SCRUB_CLAIM_MAX 64              // blocks the scrubber holds at once
+#define ZEROED_POOL_SIZE 256
+
+struct block_run {
+    uint32_t start;
+    uint32_t len;
+};
+
+// guards everything below
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scrub_released_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t scrub_releases = 0;     // bumped whenever reservations are dropped
+static bool lazy_zeroing = false;
+static bool scrubber_stop = false;
+static pthread_t scrubber_thread;
+static struct block_run* scrub_queue = NULL;
+static uint32_t scrub_queue_len = 0;
+static uint32_t scrub_queue_cap = 0;
+static uint32_t zeroed_pool[ZEROED_POOL_SIZE];
+static uint32_t zeroed_pool_len = 0;
+// only touched by the scrubber thread
+static bool scrub_punch_holes = true;
+
+static void queue_dirty_free_block(uint32_t block_num) {
+    // called for a block that was just released, consecutive blocks share one run
+    pthread_mutex_lock(&scrub_lock);
+    struct block_run* last = (scrub_queue_len > 0) ? &scrub_queue[scrub_queue_len - 1] : NULL;
+    if (last != NULL && last->start + last->len == block_num && last->len < UINT32_MAX) {
+        last->len++;
+        pthread_mutex_unlock(&scrub_lock);
+        return;
+    }
+    if (scrub_queue_len == scrub_queue_cap && scrub_queue_cap < SCRUB_QUEUE_MAX) {
+        uint32_t cap = (scrub_queue_cap > 0) ? scrub_queue_cap * 2 : 1024;
+        struct block_run* grown = realloc(scrub_queue, cap * sizeof(struct block_run));
+        if (grown != NULL) {
+            scrub_queue = grown;
+            scrub_queue_cap = cap;
+        }
+    }
+    if (scrub_queue_len < scrub_queue_cap) {
+        scrub_queue[scrub_queue_len++] = (struct block_run) { block_num, 1 };
+        pthread_cond_signal(&scrub_cond);
+    }
+    pthread_mutex_unlock(&scrub_lock);
+}
+
+static void zero_blocks(uint32_t start, uint32_t len) {
+    // zero [start, start + len), the blocks are held by the scrubber
+    if (scrub_punch_holes) {
+        if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t) start * EXT2_BLOCK_SIZE, (off_t) len * EXT2_BLOCK_SIZE) == 0) {
+            return;
+        }
+        // the file system holding the image cannot punch holes, zero the blocks instead
+        scrub_punch_holes = false;
+    }
+    memset(disk + (size_t) start * EXT2_BLOCK_SIZE, 0, (size_t) len * EXT2_BLOCK_SIZE);
+}
+
+static void scrub_claimed_blocks(uint32_t start, uint32_t len) {
+    // zero blocks reserved by the scrubber, drop the reservations and remember some for directories
+    zero_blocks(start, len);
+    uint32_t group = block_group(start);
+    uint64_t* reserved = (uint64_t*) group_block_reservations(group);
+    pthread_mutex_lock(&scrub_lock);
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t bit = (start + i - sb->s_first_data_block) % sb->s_blocks_per_group;
+        __atomic_fetch_and(&reserved[bit / 64], ~(1ULL << (bit % 64)), __ATOMIC_RELEASE);
+        if (zeroed_pool_len < ZEROED_POOL_SIZE) {
+            zeroed_pool[zeroed_pool_len++] = start + i;
+        }
+    }
+    __atomic_fetch_sub(&reserved_block_count, len, __ATOMIC_RELEASE);
+    scrub_releases++;
+    pthread_cond_broadcast(&scrub_released_cond);
+    pthread_mutex_unlock(&scrub_lock);
+}
+
+static bool wait_for_reserved_blocks() {
+    /*
+    Return value interpretation:
+    false: the scrubber holds no block, an allocation that found nothing has really run out
+    true: the scrubber dropped some of the blocks it held, the caller should look again
+
+    Called by block allocations that found no free block. The scrubber runs at idle priority,
+    so sleeping here is what lets it finish.
+    */
+    if (__atomic_load_n(&reserved_block_count, __ATOMIC_ACQUIRE) == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&scrub_lock);
+    uint64_t releases = scrub_releases;
+    while (__atomic_load_n(&reserved_block_count, __ATOMIC_ACQUIRE) > 0 && scrub_releases == releases) {
+        pthread_cond_wait(&scrub_released_cond, &scrub_lock);
+    }
+    pthread_mutex_unlock(&scrub_lock);
+    return true;
+}
+
+static void scrub_run(struct block_run run) {
+    // zero the blocks of run that are still free, at most SCRUB_CLAIM_MAX at a time; they are
+    // only reserved in memory, the bitmaps and counts keep them free throughout
+    uint32_t claimed_start = 0;
+    uint32_t claimed = 0;
+    for (uint32_t block = run.start; block < run.start + run.len; block++) {
+        uint32_t group = block_group(block);
+        if (claimed > 0 && (claimed == SCRUB_CLAIM_MAX || block_group(claimed_start) != group)) {
+            scrub_claimed_blocks(claimed_start, claimed);
+            claimed = 0;
+        }
+        uint32_t bit = (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+        uint64_t mask = 1ULL << (bit % 64);
+        uint64_t* reserved = (uint64_t*) group_block_reservations(group) + bit / 64;
+        __atomic_fetch_add(&reserved_block_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_or(reserved, mask, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (test_bitmap_bit(group_block_bitmap(group), bit)) {
+            // allocated again already, its new owner overwrites it
+            __atomic_fetch_and(reserved, ~mask, __ATOMIC_RELEASE);
+            pthread_mutex_lock(&scrub_lock);
+            __atomic_fetch_sub(&reserved_block_count, 1, __ATOMIC_RELEASE);
+            scrub_releases++;
+            pthread_cond_broadcast(&scrub_released_cond);
+            pthread_mutex_unlock(&scrub_lock);
+            if (claimed > 0) {
+                scrub_claimed_blocks(claimed_start, claimed);
+                claimed = 0;
+            }
+            continue;
+        }
+        if (claimed == 0) {
+            claimed_start = block;
+        }
+        claimed++;
+    }
+    if (claimed > 0) {
+        scrub_claimed_blocks(claimed_start, claimed);
+    }
+}
+
+static void* scrub_free_blocks(void* arg) {
+    // scrubber thread, only runs when nothing else wants the CPU
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    pthread_mutex_lock(&scrub_lock);
+    while (!scrubber_stop) {
+        if (scrub_queue_len == 0) {
+            pthread_cond_wait(&scrub_cond, &scrub_lock);
+            continue;
+        }
+        struct block_run run = scrub_queue[--scrub_queue_len];
+        pthread_mutex_unlock(&scrub_lock);
+        scrub_run(run);
+        pthread_mutex_lock(&scrub_lock);
+    }
+    pthread_mutex_unlock(&scrub_lock);
+    return NULL;
+}
+
+void start_scrubber() {
+    // switch to lazy zeroing, called by ext2_fsal_init() before any operation runs
+    scrubber_stop = false;
+    scrub_punch_holes = true;
+    reservation_words_per_group = (sb->s_blocks_per_group + 63) / 64;
+    block_reservations = calloc((size_t) group_count * reservation_words_per_group, sizeof(uint64_t));
+    if (block_reservations == NULL) {
+        // blocks keep being zeroed when freed
+        perror("calloc");
+        return;
+    }
+    if (pthread_create(&scrubber_thread, NULL, scrub_free_blocks, NULL) != 0) {
+        perror("pthread_create");
+        free(block_reservations);
+        block_reservations = NULL;
+        return;
+    }
+    lazy_zeroing = true;
+}
+
+void stop_scrubber() {
+    // blocks still queued stay as they are, free blocks need not be zero
+    if (!lazy_zeroing) {
+        return;
+    }
+    pthread_mutex_lock(&scrub_lock);
+    scrubber_stop = true;
+    pthread_cond_signal(&scrub_cond);
+    pthread_mutex_unlock(&scrub_lock);
+    pthread_join(scrubber_thread, NULL);
+
+    lazy_zeroing = false;
+    free(block_reservations);
+    block_reservations = NULL;
+    free(scrub_queue);
+    scrub_queue = NULL;
+    scrub_queue_len = 0;
+    scrub_queue_cap = 0;
+    zeroed_pool_len = 0;
 }
 
-int find_free_inode() {
-    int inode_num;
-    for (int i = 0; i < sb->s_inodes_count; i++) {
-        // check if the ith inode is in use
-        int byte_idx = i / 8;
-        int bit_idx = i % 8;
-        if (!((inode_bitmap[byte_idx] >> bit_idx) & 1)) {
-            // inode is available
-            inode_num = i + 1;
-            if (inode_num == EXT2_ROOT_INO || inode_num > EXT2_GOOD_OLD_FIRST_INO) {
+static bool is_block_zeroed(uint32_t block_num) {
+    const uint64_t* words = (const uint64_t*) (disk + (size_t) block_num * EXT2_BLOCK_SIZE);
+    for (uint32_t i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
 
-                inode_bitmap[byte_idx] |= (1 << bit_idx);
-                gd->bg_free_inodes_count--;
-                sb->s_free_inodes_count--;
+int find_zeroed_block(int goal_inode_num) {
+    /*
+    Return value interpretation:
+    -1: no free block left
+    other values: a block allocated like find_free_block() does, whose content is all zeros
 
-                return inode_num;
+    A block the scrubber zeroed in the group of goal_inode_num is preferred; it may have been
+    used and freed again since, so its content is checked before the memset is skipped.
+    */
+    uint32_t goal = inode_group(goal_inode_num);
+    pthread_mutex_lock(&scrub_lock);
+    uint32_t i = zeroed_pool_len;
+    while (i > 0) {
+        uint32_t block_num = zeroed_pool[--i];
+        if (block_group(block_num) != goal) {
+            continue;
+        }
+        zeroed_pool[i] = zeroed_pool[--zeroed_pool_len];
+        pthread_mutex_unlock(&scrub_lock);
+
+        if (claim_bit_range(group_block_bitmap(goal), group_block_reservations(goal),
+                            (block_num - sb->s_first_data_block) % sb->s_blocks_per_group, 1)) {
+            adjust_free_counts(goal, FREE_BLOCKS, -1);
+            if (!is_block_zeroed(block_num)) {
+                memset(disk + (size_t) block_num * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
             }
+            return block_num;
         }
+        // taken in the meantime, look further
+        pthread_mutex_lock(&scrub_lock);
+        i = (i < zeroed_pool_len) ? i : zeroed_pool_len;
     }
-    return -1;
-}
+    pthread_mutex_unlock(&scrub_lock);
 
-int initialize_new_inode(int mode) {
-    // allocate new inode of i_mode mode
-    int new_inode_num = find_free_inode();
-    if (new_inode_num == -1) {
-        return -1; // no space left
+    int block_num = find_free_block(goal_inode_num);
+    if (block_num != -1) {
+        memset(disk + (size_t) block_num * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
     }
-    
+    return block_num;
+}
 
-    struct ext2_inode* inode = &inode_table[new_inode_num - 1];
-    if (mode == INODE_MODE_FILE) {
-        inode->i_mode = EXT2_S_IFREG | 0644; 
-        inode->i_size = 0;
-        inode->i_blocks = 0;
-    } 
-    else if (mode == INODE_MODE_DIR) {
-        inode->i_mode = EXT2_S_IFDIR | 0755; // allow owners to read, write, exec while others can only read and exec
-        inode->i_size = EXT2_BLOCK_SIZE;
-        inode->i_blocks = EXT2_BLOCK_SIZE / 512; // i_blocks reflect actual disk sectors
-    } 
-    else {
-        // mode == INODE_MODE_LINK at this point
-        inode->i_mode = EXT2_S_IFLNK | 0777;
-        inode->i_size = 0;
-        inode->i_blocks = 0;
+static uint32_t release_block_tree(uint32_t block_num, int depth) {
+    // release a data block (depth 0) or an indirect table and every block below it,
+    // returns the number of blocks released
+    if (block_num == 0) {
+        return 0;
     }
-    
-    
-    // initalize all block pointers to 0
-    memset(inode->i_block, 0, 15 * sizeof(unsigned int));
-    return new_inode_num;
+    uint32_t released = 1;
+    unsigned char* block_data = disk + (size_t) block_num * EXT2_BLOCK_SIZE;
+    if (depth > 0) {
+        uint32_t* table = (uint32_t*) block_data;
+        for (uint32_t i = 0; i < PTRS_PER_BLOCK; i++) {
+            released += release_block_tree(table[i], depth - 1);
+        }
+    }
+    if (journal_fd != -1) {
+        // freed at the commit, and nothing writes a free block back to a journaled image
+        release_block(block_num);
+        return released;
+    }
+    if (lazy_zeroing) {
+        release_block(block_num);
+        queue_dirty_free_block(block_num);
+        return released;
+    }
+    memset(block_data, 0, EXT2_BLOCK_SIZE);
+    release_block(block_num);
+    return released;
 }
 
-int find_free_block() {
-    for (uint32_t i = 0; i < sb->s_blocks_count; i++) {
-        int byte_idx = i / 8;
-        int bit_idx = i % 8;
-        if (!((block_bitmap[byte_idx] >> bit_idx) & 1)) {
-            // block is available
-            // mark block is in use
-            block_bitmap[byte_idx] |= (1 << bit_idx);
-            gd->bg_free_blocks_count--;
-            sb->s_free_blocks_count--;
+static uint32_t truncate_block_tree(uint32_t* slot, int depth, uint32_t first_idx, uint32_t keep) {
+    // release the blocks of the tree in *slot that map logical blocks >= keep, the tree maps
+    // logical blocks from first_idx on; returns the number of blocks released
+    if (*slot == 0) {
+        return 0;
+    }
+    if (first_idx >= keep) {
+        uint32_t released = release_block_tree(*slot, depth);
+        *slot = 0;
+        return released;
+    }
+    if (depth == 0) {
+        return 0;
+    }
 
-            return i;
+    uint32_t child_span = 1;
+    for (int level = 1; level < depth; level++) {
+        child_span *= PTRS_PER_BLOCK;
+    }
+    uint32_t* table = (uint32_t*) (disk + (size_t) *slot * EXT2_BLOCK_SIZE);
+    uint32_t released = 0;
+    for (uint32_t i = 0; i < PTRS_PER_BLOCK; i++) {
+        uint32_t child_first = first_idx + i * child_span;
+        if (child_first + child_span > keep) {
+            released += truncate_block_tree(&table[i], depth - 1, child_first, keep);
         }
     }
-    return -1;
-}
-
-void release_block(int block_num) {
-    block_bitmap[block_num / 8] &= ~(1 << (block_num % 8));
-    gd->bg_free_blocks_count++;
-    sb->s_free_blocks_count++;
+    if (released > 0) {
+        // the table stays, with the entries past keep cleared
+        mark_blocks_dirty(*slot, 1);
+    }
+    return released;
 }
 
-void release_inode(int inode_num) {
-    inode_bitmap[(inode_num - 1) / 8] &= ~(1 << ((inode_num - 1) % 8));
-    gd->bg_free_inodes_count++;
-    sb->s_free_inodes_count++;
+uint32_t truncate_inode_blocks(struct ext2_inode* inode, uint32_t keep) {
+    /*
+    Release every data block of inode from logical block keep on, and the indirect tables
+    left without entries. i_size and i_blocks are left to the caller.
+    Return value: number of blocks released, tables included
+    */
+    uint32_t released = 0;
+    uint32_t first_idx = 0;
+    for (int i = 0; i < EXT2_N_BLOCKS; i++) {
+        int depth = (i < EXT2_NDIR_BLOCKS) ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+        released += truncate_block_tree(&inode->i_block[i], depth, first_idx, keep);
+        // i_block[12] maps 256 blocks, i_block[13] 256^2, i_block[14] 256^3
+        uint32_t span = 1;
+        for (int level = 0; level < depth; level++) {
+            span *= PTRS_PER_BLOCK;
+        }
+        first_idx += span;
+    }
+    return released;
 }
 
 void clear_inode_data_blocks(int inode_num) {
     // clear all data blocks of the inode with number inode_num
 
-    struct ext2_inode* inode = &inode_table[inode_num - 1];
+    struct ext2_inode* inode = get_inode(inode_num);
 
     if (is_inode_to_dir(inode_num)) {
-        // clear 15 direct pointers
-        for (int i = 0; i < 15; i++) {
+        // directories only use direct pointers
+        for (int i = 0; i < EXT2_NDIR_BLOCKS; i++) {
             if (inode->i_block[i] > 0) {
                 // free this block
-                memset(disk + inode->i_block[i] * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
-                release_block(inode->i_block[i]);
+                release_block_tree(inode->i_block[i], 0);
                 inode->i_block[i] = 0;
             }
         }
@@ -180,153 +2305,723 @@ void clear_inode_data_blocks(int inode_num) {
         inode->i_blocks = EXT2_BLOCK_SIZE / 512;
     }
     else if (is_inode_to_file(inode_num)) {
-        // clear 14 direct pointers
-        for (int i = 0; i < 14; i++) {
-            if (inode->i_block[i] > 0) {
-                // free this block
-                memset(disk + inode->i_block[i] * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
-                release_block(inode->i_block[i]);
-                inode->i_block[i] = 0;
+        // direct blocks, then the single, double and triple indirect trees
+        truncate_inode_blocks(inode, 0);
+        // reset metadata after clearing all blocks
+        inode->i_size = 0;
+        inode->i_blocks = 0;
+    }
+    else if (is_inode_to_symlink(inode_num)) {
+        // a symlink with a data block keeps its target there, otherwise in i_block itself
+        if (inode->i_blocks > 0) {
+            release_block_tree(inode->i_block[0], 0);
+        }
+        memset(inode->i_block, 0, sizeof(inode->i_block));
+        inode->i_size = 0;
+        inode->i_blocks = 0;
+    }
+    mark_inode_dirty(inode_num);
+}
+
+// Orphan list: rm only removes the directory entry. An inode whose last link is gone is put
+// on the orphan list, the ext3/ext4 on-disk list starting at s_last_orphan in the super
+// block and linked through i_dtime, and a reclaimer thread releases its blocks in slices of
+// RECLAIM_SLICE_BLOCKS, committing each slice, before releasing the inode itself. Removing a
+// file thus takes the same time whatever its size, and start_reclaimer() picks up the inodes
+// a previous run left on the list. stop_reclaimer() lets the reclaimer finish the list, so an
+// image that was shut down cleanly has no orphans; a process that exits without
+// ext2_fsal_destroy() leaves the rest for the next start_reclaimer().
+// rm never frees blocks itself: when the queue cannot grow, or the reclaimer thread could not
+// be started, the orphan just stays on the on-disk list, and the reclaimer walks the list again
+// once its queue runs empty (a later rm retries starting the thread).
+// The blocks of an orphan only become free as it is reclaimed.
+#define RECLAIM_SLICE_BLOCKS 4096
+
+// guards the orphan list (s_last_orphan and the i_dtime links) and the reclaim queue
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t orphan_cond = PTHREAD_COND_INITIALIZER;
+static int* orphan_queue = NULL;        // ring of orphans waiting for the reclaimer
+static uint32_t orphan_queue_head = 0;
+static uint32_t orphan_queue_len = 0;
+static uint32_t orphan_queue_cap = 0;
+static bool reclaimer_running = false;
+static bool reclaimer_stop = false;
+static bool orphans_unqueued = false;   // some orphans on the list are not in the queue
+static pthread_t reclaimer_thread;
+
+static bool queue_orphan_locked(int inode_num) {
+    // hand an orphan to the reclaimer, false if the queue could not grow
+    if (orphan_queue_len == orphan_queue_cap) {
+        uint32_t cap = (orphan_queue_cap > 0) ? orphan_queue_cap * 2 : 64;
+        int* grown = malloc(cap * sizeof(int));
+        if (grown == NULL) {
+            return false;
+        }
+        for (uint32_t i = 0; i < orphan_queue_len; i++) {
+            grown[i] = orphan_queue[(orphan_queue_head + i) % orphan_queue_cap];
+        }
+        free(orphan_queue);
+        orphan_queue = grown;
+        orphan_queue_head = 0;
+        orphan_queue_cap = cap;
+    }
+    orphan_queue[(orphan_queue_head + orphan_queue_len) % orphan_queue_cap] = inode_num;
+    orphan_queue_len++;
+    pthread_cond_signal(&orphan_cond);
+    return true;
+}
+
+static void queue_listed_orphans_locked() {
+    // queue the orphans on the on-disk list, called while none of them is queued or being
+    // reclaimed: at start up, and by the reclaimer once its queue ran empty
+    orphans_unqueued = false;
+    uint32_t* link = &sb->s_last_orphan;
+    for (uint32_t steps = 0; *link != 0; steps++) {
+        int inode_num = *link;
+        if (steps >= sb->s_inodes_count || inode_num < EXT2_GOOD_OLD_FIRST_INO || (uint32_t) inode_num > sb->s_inodes_count
+            || !is_inode_in_use(inode_num) || get_inode(inode_num)->i_links_count != 0) {
+            // a broken list, cut it here and leave the rest to e2fsck
+            fprintf(stderr, "ext2_fsal: orphan list broken at inode %d\n", inode_num);
+            *link = 0;
+            mark_dirty(link, sizeof(*link));
+            break;
+        }
+        if (!queue_orphan_locked(inode_num)) {
+            orphans_unqueued = true;
+            break;
+        }
+        link = &get_inode(inode_num)->i_dtime;
+    }
+}
+
+static void unlink_orphan(int inode_num) {
+    // take a reclaimed inode off the on-disk orphan list
+    pthread_mutex_lock(&orphan_lock);
+    uint32_t next = get_inode(inode_num)->i_dtime;
+    if (sb->s_last_orphan == (uint32_t) inode_num) {
+        sb->s_last_orphan = next;
+        mark_dirty(&sb->s_last_orphan, sizeof(sb->s_last_orphan));
+    }
+    else {
+        // orphans are usually reclaimed soon after being added, so the list is short
+        uint32_t prev = sb->s_last_orphan;
+        for (uint32_t steps = 0; prev != 0 && steps < sb->s_inodes_count; steps++) {
+            struct ext2_inode* prev_inode = get_inode(prev);
+            if (prev_inode->i_dtime == (uint32_t) inode_num) {
+                prev_inode->i_dtime = next;
+                mark_inode_dirty(prev);
+                break;
             }
+            prev = prev_inode->i_dtime;
+        }
+    }
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+static void reclaim_slice(int inode_num, uint32_t keep) {
+    // release the blocks of an orphan from logical block keep on
+    struct ext2_inode* inode = get_inode(inode_num);
+    uint32_t released = truncate_inode_blocks(inode, keep);
+    if ((uint64_t) inode->i_size > (uint64_t) keep * EXT2_BLOCK_SIZE) {
+        inode->i_size = keep * EXT2_BLOCK_SIZE;
+    }
+    uint32_t sectors = released * (EXT2_BLOCK_SIZE / 512);
+    inode->i_blocks = (inode->i_blocks > sectors) ? inode->i_blocks - sectors : 0;
+    mark_inode_dirty(inode_num);
+}
+
+static void reclaim_orphan(int inode_num) {
+    // free an orphan slice by slice, every slice is committed like an operation; nothing
+    // else can reach the inode, the lock only keeps the lock order checks honest
+    // views taken before the last link went away still show the blocks; no new one can be
+    // taken without a name, so wait before joining the transaction instead of stalling it
+    wait_for_inode_views(inode_num);
+    begin_op();
+    lock_inode(inode_num, true);
+    struct ext2_inode* inode = get_inode(inode_num);
+    // a symlink without a data block keeps its target in i_block[], there is nothing to free
+    if (!(is_inode_to_symlink(inode_num) && inode->i_blocks == 0)) {
+        uint32_t data_blocks = ((uint64_t) inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        while (data_blocks > 0) {
+            uint32_t keep = (data_blocks > RECLAIM_SLICE_BLOCKS) ? data_blocks - RECLAIM_SLICE_BLOCKS : 0;
+            reclaim_slice(inode_num, keep);
+            data_blocks = keep;
+            unlock_inode(inode_num);
+            commit_op();
+            begin_op();
+            lock_inode(inode_num, true);
         }
+        // blocks past i_size, if any
+        reclaim_slice(inode_num, 0);
+    }
+    memset(inode->i_block, 0, sizeof(inode->i_block));
+
+    unlink_orphan(inode_num);
+    inode->i_dtime = time(NULL);
+    mark_inode_dirty(inode_num);
+    release_inode(inode_num);
+    unlock_inode(inode_num);
+    commit_op();
+}
 
-        // clear indirect pointer if valid
-        if (inode->i_block[14] != 0) {
-            // free indirect table
-            int indirect_block_num = inode->i_block[14];
-            uint32_t* indirect_table = disk + indirect_block_num * EXT2_BLOCK_SIZE;
-            int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(uint32_t);
-            for (int i = 0; i < max_indirect_blocks; i++) {
-                int block_num = indirect_table[i];
-                if (block_num > 0) {
-                    memset(disk + block_num * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
-                    release_block(block_num);
+static void* reclaim_orphans(void* arg) {
+    // reclaimer thread, empties the queue before it stops
+    pthread_mutex_lock(&orphan_lock);
+    while (true) {
+        if (orphan_queue_len == 0) {
+            if (orphans_unqueued) {
+                queue_listed_orphans_locked();
+                if (orphan_queue_len > 0) {
+                    continue;
                 }
-                
             }
-            memset(disk + indirect_block_num * EXT2_BLOCK_SIZE, 0, EXT2_BLOCK_SIZE);
-            release_block(indirect_block_num);
-            inode->i_block[14] = 0;
+            if (reclaimer_stop) {
+                break;
+            }
+            pthread_cond_wait(&orphan_cond, &orphan_lock);
+            continue;
         }
-        // reset metadata after clearing all blocks
-        inode->i_size = 0;
-        inode->i_blocks = 0;
+        int inode_num = orphan_queue[orphan_queue_head];
+        orphan_queue_head = (orphan_queue_head + 1) % orphan_queue_cap;
+        orphan_queue_len--;
+        pthread_mutex_unlock(&orphan_lock);
+        reclaim_orphan(inode_num);
+        pthread_mutex_lock(&orphan_lock);
+    }
+    pthread_mutex_unlock(&orphan_lock);
+    return NULL;
+}
+
+void orphan_inode(int inode_num) {
+    // the last link of inode_num is gone: put it on the orphan list for the reclaimer;
+    // the caller holds the inode's write lock
+    struct ext2_inode* inode = get_inode(inode_num);
+    pthread_mutex_lock(&orphan_lock);
+    inode->i_dtime = sb->s_last_orphan;
+    sb->s_last_orphan = inode_num;
+    mark_inode_dirty(inode_num);
+    mark_dirty(&sb->s_last_orphan, sizeof(sb->s_last_orphan));
+    if (!reclaimer_running && !reclaimer_stop) {
+        // the thread could not be started so far, the list is walked once it runs
+        orphans_unqueued = true;
+        if (pthread_create(&reclaimer_thread, NULL, reclaim_orphans, NULL) == 0) {
+            reclaimer_running = true;
+        }
+    }
+    else if (reclaimer_running && !orphans_unqueued && !queue_orphan_locked(inode_num)) {
+        // the reclaimer picks it up from the list when its queue runs empty
+        orphans_unqueued = true;
+    }
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+void drop_link(int inode_num) {
+    // remove one link of a file or symlink, the caller holds its write lock
+    struct ext2_inode* inode = get_inode(inode_num);
+    if (inode->i_links_count > 0) {
+        inode->i_links_count--;
+    }
+    mark_inode_dirty(inode_num);
+    if (inode->i_links_count == 0) {
+        orphan_inode(inode_num);
+    }
+}
+
+void start_reclaimer() {
+    // called by ext2_fsal_init() before any operation runs: queue the orphans an earlier run
+    // did not get to, then start reclaiming
+    pthread_mutex_lock(&orphan_lock);
+    reclaimer_stop = false;
+    reclaimer_running = true;
+    queue_listed_orphans_locked();
+    pthread_mutex_unlock(&orphan_lock);
+
+    if (pthread_create(&reclaimer_thread, NULL, reclaim_orphans, NULL) != 0) {
+        // orphans stay on the list, the next rm tries again
+        perror("pthread_create");
+        pthread_mutex_lock(&orphan_lock);
+        reclaimer_running = false;
+        orphans_unqueued = true;
+        pthread_mutex_unlock(&orphan_lock);
+    }
+}
+
+void stop_reclaimer() {
+    // wait for the reclaimer to empty the orphan list
+    pthread_mutex_lock(&orphan_lock);
+    bool running = reclaimer_running;
+    reclaimer_stop = true;
+    reclaimer_running = false;
+    pthread_cond_signal(&orphan_cond);
+    pthread_mutex_unlock(&orphan_lock);
+    if (running) {
+        pthread_join(reclaimer_thread, NULL);
+    }
+
+    free(orphan_queue);
+    orphan_queue = NULL;
+    orphan_queue_head = 0;
+    orphan_queue_len = 0;
+    orphan_queue_cap = 0;
+    orphans_unqueued = false;
+}
+
+// inode locks
+// Lock order, to keep concurrent commands deadlock free:
+// 1. directory inode locks, parent before child (resolve_path() couples them top-down)
+// 2. at most one non-directory inode lock, taken last
+// 3. the free count, dentry cache and orphan list mutexes, never held while waiting for an inode lock
+//    (free_counts_lock is taken before group_desc_lock / superblock_lock, those two are never nested)
+// (bitmaps need no lock, bits are claimed and released with atomics)
+void lock_inode(int inode_num, bool for_write) {
+    if (for_write) {
+        pthread_rwlock_wrlock(&inode_locks[inode_num - 1]);
+    } else {
+        pthread_rwlock_rdlock(&inode_locks[inode_num - 1]);
+    }
+}
+
+void unlock_inode(int inode_num) {
+    pthread_rwlock_unlock(&inode_locks[inode_num - 1]);
+}
+
+// Views handed out by ext2_fsal_read() point into the blocks of a file, which stay pinned
+// until the caller releases them. A pin is taken under the inode's read lock, and a writer
+// about to change or free the blocks of a file waits for its pins under the write lock, so
+// no new pin shows up meanwhile. Unlike an inode lock a pin belongs to no thread and is held
+// across calls.
+static pthread_mutex_t view_pins_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t view_pins_cond = PTHREAD_COND_INITIALIZER;
+
+void pin_inode_views(int inode_num) {
+    // the caller holds a lock on inode_num
+    pthread_mutex_lock(&view_pins_lock);
+    inode_view_pins[inode_num - 1]++;
+    pthread_mutex_unlock(&view_pins_lock);
+}
+
+void unpin_inode_views(int inode_num) {
+    pthread_mutex_lock(&view_pins_lock);
+    if (inode_view_pins[inode_num - 1] > 0 && --inode_view_pins[inode_num - 1] == 0) {
+        pthread_cond_broadcast(&view_pins_cond);
+    }
+    pthread_mutex_unlock(&view_pins_lock);
+}
+
+void wait_for_inode_views(int inode_num) {
+    // the caller is about to change the blocks of inode_num, holding its write lock unless
+    // nothing can reach the inode any more
+    pthread_mutex_lock(&view_pins_lock);
+    while (inode_view_pins[inode_num - 1] > 0) {
+        pthread_cond_wait(&view_pins_cond, &view_pins_lock);
+    }
+    pthread_mutex_unlock(&view_pins_lock);
+}
+
+static void move_dir_lock(int held_inode_num, int next_inode_num, bool next_for_write, const char* name, int name_len) {
+    // trade the lock on held_inode_num for a lock on its entry next_inode_num (reached through name)
+    if (next_inode_num == held_inode_num) {
+        // "." (or ".." of the root), only the mode may have to change
+        unlock_inode(held_inode_num);
+        lock_inode(next_inode_num, next_for_write);
+    }
+    else if (name_len == 2 && name[0] == '.' && name[1] == '.') {
+        // never wait for an ancestor while holding a descendant,
+        // directories are never removed so the ancestor is still there afterwards
+        unlock_inode(held_inode_num);
+        lock_inode(next_inode_num, next_for_write);
+    }
+    else {
+        // lock coupling: the entry cannot be removed while its directory is held
+        lock_inode(next_inode_num, next_for_write);
+        unlock_inode(held_inode_num);
     }
-    
 }
 
-// path validation
-int validate_path_exists(const char* path) {
+// path resolution
+static const char* next_path_component(const char* cursor, const char** name, int* name_len) {
     /*
+    Skip separators, then cut out the next component.
     Return value interpretation:
-    0: path exists
-    -1: last name of path does not exist
-    -2: intermediate folder does not exist or exists as a file 
+    NULL: there are no components left
+    other values: position right after the component, *name and *name_len describe it
     */
-    // create a copy of path since strtok modifies the string
-    size_t path_len = strlen(path);
-    char path_copy[path_len + 1];
-    strncpy(path_copy, path, path_len);
-    path_copy[path_len] = '\0';
-    const char* delimiter = "/";
-    char* saveptr;
-    char* token = strtok_r(path_copy, delimiter, &saveptr);
-    int current_inode_num = EXT2_ROOT_INO;
-    char* next_token;
-    while (token != NULL) {
-        next_token = strtok_r(NULL, delimiter, &saveptr);
-        // check if this token is a valid entry of current parent dir
-        int child_inode = get_child_inode_num(current_inode_num, token);
+    while (*cursor == '/') {
+        cursor++;
+    }
+    if (*cursor == '\0') {
+        return NULL;
+    }
+    *name = cursor;
+    while (*cursor != '\0' && *cursor != '/') {
+        cursor++;
+    }
+    *name_len = cursor - *name;
+    return cursor;
+}
 
-        // there exists a dir entry with same name as token
-        if (next_token != NULL) {
-            if (child_inode == -1){
-                return -2;
-            }
-            // check if inode is pointing to a directory
-            if (!is_inode_to_dir(child_inode)) {
-                // this means token is not the last name of the path
-                // but token is not a directory 
-                return -2; // path is invalid
-            }
-        }
-        else {
-            if (child_inode == -1) {
-                return -1;
-            }
-        }
-        
-        token = next_token; // move on to the next token
-        // update current_inode_num
-        current_inode_num = child_inode;
+static bool is_last_path_component(const char* cursor) {
+    // cursor points right after a component, only trailing slashes may follow the last one
+    while (*cursor == '/') {
+        cursor++;
     }
-    // path passes all the invalidation check
-    return 0;
+    return *cursor == '\0';
 }
 
-void traverse_path(const char* path, int* parent_inode, int* child_inode) {
+void resolve_path(const char* path, struct path_lookup* lookup, bool write_parent) {
     /*
-    This function assumes path is a valid path.
-    parent_inode points to the inode of the immediate parent directory
-    child_inode points to the inode of the last name of the path
+    Walk path from the root directory in a single pass, without copying or tokenizing it.
+    Repeated and trailing slashes are skipped while walking.
+
+    On return lookup->status tells how far the walk got:
+    PATH_EXISTS: every component exists, child_inode_num is the inode of the last one
+    PATH_MISSING: all but the last component exist, child_inode_num is -1
+    PATH_BAD_PREFIX: an intermediate folder does not exist or exists as a file
+    PATH_NAME_TOO_LONG: the missing last component is longer than EXT2_NAME_LEN
+    parent_inode_num is the directory holding the last component, name/name_len point
+    at the last component inside path (not zero terminated).
+    For "/" the root is both the parent and the child, and name_len is 0.
+
+    Directories on the way are read locked hand over hand. For PATH_EXISTS and PATH_MISSING
+    the parent stays locked (for writing if write_parent is set) until release_path().
     */
-    size_t path_len = strlen(path);
-    char path_copy[path_len + 1];
-    strncpy(path_copy, path, path_len);
-    path_copy[path_len] = '\0';
-    const char* delimiter = "/";
-    char* saveptr;
-    char* token = strtok_r(path_copy, delimiter, &saveptr);
-    char* next_token;
+    const char* name = path;
+    int name_len = 0;
+    const char* cursor = next_path_component(path, &name, &name_len);
+
+    // the root is the parent of a single component path and of "/" itself
     int current_inode_num = EXT2_ROOT_INO;
-    int parent_inode_num = current_inode_num;
-    while (token != NULL) {
-        next_token = strtok_r(NULL, delimiter, &saveptr);
-        int child_inode_num = get_child_inode_num(current_inode_num, token);
-        if (next_token == NULL) {
-            // save immediate parent directory
-            *parent_inode = parent_inode_num;
-            // token now holds the last name of the path
-            *child_inode = child_inode_num;
-        }
-        parent_inode_num = current_inode_num;
-        token = next_token;
+    lock_inode(current_inode_num, write_parent && (cursor == NULL || is_last_path_component(cursor)));
+
+    lookup->parent_inode_num = EXT2_ROOT_INO;
+    lookup->child_inode_num = EXT2_ROOT_INO;
+    lookup->locked_inode_num = EXT2_ROOT_INO;
+    lookup->name = path;
+    lookup->name_len = 0;
+    lookup->status = PATH_EXISTS;
+
+    while (cursor != NULL) {
+        bool is_last = is_last_path_component(cursor);
+        lookup->parent_inode_num = current_inode_num;
+        lookup->name = name;
+        lookup->name_len = name_len;
+        lookup->child_inode_num = -1;
+
+        // a name this long cannot be in any directory, skip the lookup
+        int child_inode_num = (name_len > EXT2_NAME_LEN) ? -1 : get_child_inode_num(current_inode_num, name, name_len);
+        if (child_inode_num == -1) {
+            if (is_last) {
+                lookup->status = (name_len > EXT2_NAME_LEN) ? PATH_NAME_TOO_LONG : PATH_MISSING;
+                if (lookup->status == PATH_MISSING) {
+                    return; // keep the parent locked, the caller is going to add the entry
+                }
+            } else {
+                lookup->status = PATH_BAD_PREFIX;
+            }
+            release_path(lookup);
+            return;
+        }
+        if (is_last) {
+            lookup->child_inode_num = child_inode_num;
+            return;
+        }
+        if (!is_inode_to_dir(child_inode_num)) {
+            // the component is a file or symlink, so it cannot have children
+            lookup->status = PATH_BAD_PREFIX;
+            release_path(lookup);
+            return;
+        }
+
+        // look one component ahead: if it is the last one, the child is the parent to return
+        const char* next_name = NULL;
+        int next_name_len = 0;
+        const char* next_cursor = next_path_component(cursor, &next_name, &next_name_len);
+        move_dir_lock(current_inode_num, child_inode_num, write_parent && is_last_path_component(next_cursor), name, name_len);
+
         current_inode_num = child_inode_num;
+        lookup->locked_inode_num = current_inode_num;
+        name = next_name;
+        name_len = next_name_len;
+        cursor = next_cursor;
+    }
+}
+
+void hold_child_dir(struct path_lookup* lookup) {
+    // for PATH_EXISTS on a directory: move the write lock from the parent to the child,
+    // so entries can be added to the child itself
+    if (lookup->locked_inode_num == lookup->child_inode_num) {
+        return; // "/" resolves to the root, which is already held
+    }
+    move_dir_lock(lookup->locked_inode_num, lookup->child_inode_num, true, lookup->name, lookup->name_len);
+    lookup->locked_inode_num = lookup->child_inode_num;
+}
+
+void hold_child_for_read(struct path_lookup* lookup) {
+    // for PATH_EXISTS: trade the read lock on the parent for a read lock on the child itself,
+    // whatever its type, so its inode and blocks stay put while they are read
+    if (lookup->locked_inode_num == lookup->child_inode_num) {
+        return; // "/" resolves to the root, which is already held
+    }
+    move_dir_lock(lookup->locked_inode_num, lookup->child_inode_num, false, lookup->name, lookup->name_len);
+    lookup->locked_inode_num = lookup->child_inode_num;
+}
+
+void release_path(struct path_lookup* lookup) {
+    // drop whatever directory lock resolve_path() left behind, safe to call more than once
+    if (lookup->locked_inode_num > 0) {
+        unlock_inode(lookup->locked_inode_num);
+        lookup->locked_inode_num = 0;
+    }
+}
+
+// dentry cache: hashed (parent inode, name) -> child inode, so repeated path walks
+// through the same directories skip the directory block scans
+struct dentry {
+    struct dentry* next;
+    int parent_inode_num;
+    int child_inode_num;
+    int name_len;
+    char name[];
+};
+
+#define DCACHE_INITIAL_BUCKETS 256
+
+static struct dentry** dcache_buckets = NULL;
+static uint32_t dcache_num_buckets = 0;
+static uint32_t dcache_num_entries = 0;
+
+// one bit per inode, set once every entry of that directory is in the cache,
+// from then on a cache miss means the name does not exist in the directory
+static unsigned char* dcache_indexed_dirs = NULL;
+
+// readers of a directory share its inode lock, so the cache needs its own lock;
+// every dcache_*_locked() helper expects it to be held
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dcache_forget_dir_locked(int dir_inode_num);
+
+static uint32_t dcache_hash(int parent_inode_num, const char* name, int name_len) {
+    // FNV-1a over the name, seeded with the parent inode number
+    uint32_t hash = 2166136261u ^ (uint32_t) parent_inode_num;
+    for (int i = 0; i < name_len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool dcache_grow() {
+    // double the bucket array (or create it) and rehash all entries
+    uint32_t new_num_buckets = dcache_num_buckets ? dcache_num_buckets * 2 : DCACHE_INITIAL_BUCKETS;
+    struct dentry** new_buckets = calloc(new_num_buckets, sizeof(struct dentry*));
+    if (new_buckets == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < dcache_num_buckets; i++) {
+        struct dentry* entry = dcache_buckets[i];
+        while (entry != NULL) {
+            struct dentry* next = entry->next;
+            uint32_t idx = dcache_hash(entry->parent_inode_num, entry->name, entry->name_len) & (new_num_buckets - 1);
+            entry->next = new_buckets[idx];
+            new_buckets[idx] = entry;
+            entry = next;
+        }
     }
+    free(dcache_buckets);
+    dcache_buckets = new_buckets;
+    dcache_num_buckets = new_num_buckets;
+    return true;
 }
 
-char* get_path_to_parent(const char* path) {
-    // return path to the parent directory
-    // useful when the last name of path is not an existing file
-    size_t path_len = strlen(path);
-    char* path_copy = malloc(path_len + 1);
-    if (path_copy == NULL) {
+static struct dentry** dcache_find_slot(int parent_inode_num, const char* name, int name_len) {
+    // return the link pointing at the matching entry, or NULL if it is not cached
+    if (dcache_num_buckets == 0) {
         return NULL;
     }
-    strncpy(path_copy, path, path_len);
-    path_copy[path_len] = '\0';
-    char* last_slash = strrchr(path_copy, '/'); // get last occurence of slash
-    if (last_slash != NULL) {
-        *last_slash = '\0'; // truncate at the last slash
+    uint32_t idx = dcache_hash(parent_inode_num, name, name_len) & (dcache_num_buckets - 1);
+    for (struct dentry** slot = &dcache_buckets[idx]; *slot != NULL; slot = &(*slot)->next) {
+        struct dentry* entry = *slot;
+        if (entry->parent_inode_num == parent_inode_num && entry->name_len == name_len &&
+            memcmp(entry->name, name, name_len) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static bool is_dir_indexed(int dir_inode_num) {
+    if (dcache_indexed_dirs == NULL) {
+        return false;
+    }
+    return (dcache_indexed_dirs[(dir_inode_num - 1) / 8] >> ((dir_inode_num - 1) % 8)) & 1;
+}
+
+static void set_dir_indexed(int dir_inode_num, bool indexed) {
+    if (dcache_indexed_dirs == NULL) {
+        if (!indexed) {
+            return;
+        }
+        dcache_indexed_dirs = calloc((sb->s_inodes_count + 7) / 8, 1);
+        if (dcache_indexed_dirs == NULL) {
+            return;
+        }
+    }
+    if (indexed) {
+        dcache_indexed_dirs[(dir_inode_num - 1) / 8] |= (1 << ((dir_inode_num - 1) % 8));
+    } else {
+        dcache_indexed_dirs[(dir_inode_num - 1) / 8] &= ~(1 << ((dir_inode_num - 1) % 8));
+    }
+}
+
+static int dcache_lookup_locked(int parent_inode_num, const char* name, int name_len) {
+    /*
+    Return value interpretation:
+    -1: (parent_inode_num, name) is not cached
+    (for a fully indexed directory this means there is no such entry)
+    other values: cached inode number of the entry
+    */
+    struct dentry** slot = dcache_find_slot(parent_inode_num, name, name_len);
+    return slot != NULL ? (*slot)->child_inode_num : -1;
+}
+
+static void dcache_insert_locked(int parent_inode_num, const char* name, int name_len, int child_inode_num) {
+    // only fully indexed directories are cached, any other directory gets scanned
+    // and indexed as a whole on its next lookup anyway
+    if (!is_dir_indexed(parent_inode_num)) {
+        return;
+    }
+
+    struct dentry** slot = dcache_find_slot(parent_inode_num, name, name_len);
+    if (slot != NULL) {
+        (*slot)->child_inode_num = child_inode_num;
+        return;
+    }
+
+    // keep chains short, on average at most one entry per bucket
+    struct dentry* entry = NULL;
+    if (dcache_num_entries < dcache_num_buckets || dcache_grow() || dcache_num_buckets != 0) {
+        entry = malloc(sizeof(struct dentry) + name_len);
+    }
+    if (entry == NULL) {
+        // the cache is only an optimization, so running out of memory is not an error,
+        // but the directory is no longer fully indexed and has to be scanned again
+        dcache_forget_dir_locked(parent_inode_num);
+        return;
+    }
+    entry->parent_inode_num = parent_inode_num;
+    entry->child_inode_num = child_inode_num;
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len);
+
+    uint32_t idx = dcache_hash(parent_inode_num, name, name_len) & (dcache_num_buckets - 1);
+    entry->next = dcache_buckets[idx];
+    dcache_buckets[idx] = entry;
+    dcache_num_entries++;
+}
+
+static void dcache_remove_locked(int parent_inode_num, const char* name, int name_len) {
+    // called whenever a directory entry goes away so a stale inode is never returned
+    struct dentry** slot = dcache_find_slot(parent_inode_num, name, name_len);
+    if (slot == NULL) {
+        return;
+    }
+    struct dentry* entry = *slot;
+    *slot = entry->next;
+    free(entry);
+    dcache_num_entries--;
+}
+
+static void dcache_forget_dir_locked(int dir_inode_num) {
+    // drop every cached entry of a directory, e.g. when its inode is released and may be reused
+    if (!is_dir_indexed(dir_inode_num)) {
+        return; // only indexed directories have cached entries
+    }
+    set_dir_indexed(dir_inode_num, false);
+    for (uint32_t i = 0; i < dcache_num_buckets; i++) {
+        struct dentry** slot = &dcache_buckets[i];
+        while (*slot != NULL) {
+            struct dentry* entry = *slot;
+            if (entry->parent_inode_num == dir_inode_num) {
+                *slot = entry->next;
+                free(entry);
+                dcache_num_entries--;
+            } else {
+                slot = &entry->next;
+            }
+        }
+    }
+}
+
+int dcache_lookup(int parent_inode_num, const char* name, int name_len) {
+    pthread_mutex_lock(&dcache_lock);
+    int child_inode_num = dcache_lookup_locked(parent_inode_num, name, name_len);
+    pthread_mutex_unlock(&dcache_lock);
+    return child_inode_num;
+}
+
+void dcache_insert(int parent_inode_num, const char* name, int name_len, int child_inode_num) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_insert_locked(parent_inode_num, name, name_len, child_inode_num);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_remove(int parent_inode_num, const char* name, int name_len) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_remove_locked(parent_inode_num, name, name_len);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_forget_dir(int dir_inode_num) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_forget_dir_locked(dir_inode_num);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_destroy() {
+    for (uint32_t i = 0; i < dcache_num_buckets; i++) {
+        struct dentry* entry = dcache_buckets[i];
+        while (entry != NULL) {
+            struct dentry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
     }
-    return path_copy;
+    free(dcache_buckets);
+    dcache_buckets = NULL;
+    dcache_num_buckets = 0;
+    dcache_num_entries = 0;
+
+    free(dcache_indexed_dirs);
+    dcache_indexed_dirs = NULL;
 }
 
-int get_child_inode_num(int parent_inode_num, const char* child_name) {
+int get_child_inode_num(int parent_inode_num, const char* child_name, int child_name_len) {
     /*
     Return value interpretation: 
     -1: entry with name child_name not found in parent dir
     other values: inode number (1-based index) of entry with name child_name
+    child_name holds child_name_len characters and does not have to be zero terminated
+    The caller must hold the lock of the parent directory, at least for reading.
     */
- 
-    // get inode_table first
-    struct ext2_inode *inode_table = (struct ext2_inode*) (disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    pthread_mutex_lock(&dcache_lock);
+    if (is_dir_indexed(parent_inode_num)) {
+        // every entry of the parent is cached, no need to touch its blocks
+        int cached_inode_num = dcache_lookup_locked(parent_inode_num, child_name, child_name_len);
+        pthread_mutex_unlock(&dcache_lock);
+        return cached_inode_num;
+    }
 
-    // inode number starts at 1 so need to convert to 0-based index
-    struct ext2_inode *parent_inode = &inode_table[parent_inode_num - 1];
+    // first lookup in this directory: scan it once and index all live entries
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
+    int child_inode_num = -1;
+    set_dir_indexed(parent_inode_num, true);
 
-    // iterate through data blocks of parent dir
-    for (int block = 0; block < 15; block++) {
+    // iterate through the allocated data blocks of parent dir
+    int num_blocks = parent_inode->i_size / EXT2_BLOCK_SIZE;
+    for (int block = 0; block < EXT2_NDIR_BLOCKS && num_blocks > 0; block++) {
+        if (parent_inode->i_block[block] == 0) {
+            continue;
+        }
+        num_blocks--;
 
         // beginning of block
         unsigned char* dir_block = disk + parent_inode->i_block[block] * EXT2_BLOCK_SIZE;
@@ -335,24 +3030,24 @@ int get_child_inode_num(int parent_inode_num, const char* child_name) {
         // read dir entries
         while (offset < EXT2_BLOCK_SIZE) {
             struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry*) (dir_block + offset);
-            
+            if (dir_entry->rec_len == 0) {
+                break; // corrupted block, do not loop forever
+            }
+
             if (is_inode_in_use(dir_entry->inode)) {
                 // only proceed with valid dir entries
-
-                // buffer to store name of dir entry
-                char name[dir_entry->name_len + 1];
-                strncpy(name, dir_entry->name, dir_entry->name_len);
-                name[dir_entry->name_len] = '\0';
-
-                if (strcmp(name, child_name) == 0) {
-                    return dir_entry->inode;
+                if (dir_entry->name_len == child_name_len &&
+                    memcmp(dir_entry->name, child_name, child_name_len) == 0) {
+                    child_inode_num = dir_entry->inode;
                 }
+                dcache_insert_locked(parent_inode_num, dir_entry->name, dir_entry->name_len, dir_entry->inode);
             }
             offset += dir_entry->rec_len;
         }
     }
-    // entry with name child_name is not found in parent dir at this point
-    return -1;
+    pthread_mutex_unlock(&dcache_lock);
+    // if the cache ran out of memory the directory is left unindexed, but the scan result still holds
+    return child_inode_num;
 }
 
 bool is_inode_to_dir(int inode_num) {
@@ -361,9 +3056,9 @@ bool is_inode_to_dir(int inode_num) {
         return false;
     }
 
-    struct ext2_inode* inode = &inode_table[inode_num - 1]; // inode starts from 1
+    struct ext2_inode* inode = get_inode(inode_num); // inode starts from 1
     
-    return inode->i_mode == EXT2_FT_DIR; 
+    return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR; 
 }
 
 bool is_inode_to_file(int inode_num) {
@@ -372,9 +3067,9 @@ bool is_inode_to_file(int inode_num) {
         return false;
     }
 
-    struct ext2_inode* inode = &inode_table[inode_num - 1];
+    struct ext2_inode* inode = get_inode(inode_num);
 
-    return inode->i_mode == EXT2_FT_REG_FILE;
+    return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG;
 }
 
 bool is_inode_to_symlink(int inode_num) {
@@ -383,25 +3078,24 @@ bool is_inode_to_symlink(int inode_num) {
         return false;
     }
 
-    struct ext2_inode* inode = &inode_table[inode_num - 1];
+    struct ext2_inode* inode = get_inode(inode_num);
 
-    return inode->i_mode == EXT2_FT_SYMLINK;
+    return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK;
 }
 
-bool has_space_in_parent_last_used_block(int parent_inode_num, const char* new_dir_name) {
+bool has_space_in_parent_last_used_block(int parent_inode_num, int name_len) {
 
     
-    // calculate amount of space needed for a new dir entry with name = new_dir_name
+    // calculate amount of space needed for a new dir entry with a name of name_len characters
     int metadata_bytes = 8; // 4 bytes for inode, 2 bytes for rec_len, 1 byte for name_len, 1 byte for file_type
-    int name_len = (int) strlen(new_dir_name);
     int new_padding = ((name_len + metadata_bytes) % 4 == 0) ? 0 : (4 - ((name_len + metadata_bytes) % 4));
     int new_entry_size = name_len + metadata_bytes + new_padding;
 
-    struct ext2_inode *parent_inode = &inode_table[parent_inode_num - 1];
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
 
     // find the last used block
     int last_block_idx = -1;
-    for (int i = 0; i < 15; i++) {
+    for (int i = 0; i < EXT2_NDIR_BLOCKS; i++) {
         if (parent_inode->i_block[i] != 0) {
             last_block_idx = i;
         }
@@ -445,9 +3139,9 @@ bool has_space_in_parent_last_used_block(int parent_inode_num, const char* new_d
 }
 
 int allocate_new_block_for_parent(int parent_inode_num) {
-    struct ext2_inode *parent_inode = &inode_table[parent_inode_num - 1];
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
     int next_block_idx = -1;
-    for (int i = 0; i < 15; i++) {
+    for (int i = 0; i < EXT2_NDIR_BLOCKS; i++) {
         if (parent_inode->i_block[i] == 0) {
             next_block_idx = i; // found an available direct block
             break;
@@ -459,25 +3153,8 @@ int allocate_new_block_for_parent(int parent_inode_num) {
         return -1;
     }
 
-    // allocate new available block
-    int new_block = -1;
-    for (uint32_t i = 0; i < sb->s_blocks_count; i++) {
-        int byte_idx = i / 8;
-        int bit_idx = i % 8;
-        if (!((block_bitmap[byte_idx] >> bit_idx) & 1)) {
-            // block is available
-            new_block = i;
-            // update metadata
-            // update block bitmap
-            block_bitmap[new_block / 8] |=  1 << (new_block % 8);
-
-            // update group descriptor
-            gd->bg_free_blocks_count--;
-
-            // update super block
-            sb->s_free_blocks_count--;
-        }
-    }
+    // allocate new available block, zeroed
+    int new_block = find_zeroed_block(parent_inode_num);
 
     if (new_block == -1) {
         // no space left
@@ -494,31 +3171,33 @@ int allocate_new_block_for_parent(int parent_inode_num) {
     // the i_blocks attribute reflect the number physical disk sector required
     parent_inode->i_blocks += (EXT2_BLOCK_SIZE / 512);
 
-    // zero out new block
-    char* new_block_data = (char*) (disk + new_block * EXT2_BLOCK_SIZE);
-    memset(new_block_data, 0, EXT2_BLOCK_SIZE);
+    mark_inode_dirty(parent_inode_num);
+    mark_blocks_dirty(new_block, 1);
 
     return new_block;
 }
 
-void add_dir_entry_to_new_block(int parent_inode_num, int new_inode_num, char* dir, int new_block, int file_type) {
+void add_dir_entry_to_new_block(int parent_inode_num, int new_inode_num, const char* dir, int dir_len, int new_block, int file_type) {
     struct ext2_dir_entry *new_entry = (struct ext2_dir_entry *) (disk + new_block * EXT2_BLOCK_SIZE);
     new_entry->inode = new_inode_num;
-    new_entry->name_len = strlen(dir);
-    strncpy(new_entry->name, dir, strlen(dir));
+    new_entry->name_len = dir_len;
+    memcpy(new_entry->name, dir, dir_len);
     new_entry->file_type = file_type;
     // since this is the first entry to a new block
     new_entry->rec_len = EXT2_BLOCK_SIZE;
+    mark_blocks_dirty(new_block, 1);
+
+    dcache_insert(parent_inode_num, dir, new_entry->name_len, new_inode_num);
 
 }
 
-void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, char* dir, int file_type) {
+void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, const char* dir, int dir_len, int file_type) {
     // find last used block first
-    struct ext2_inode *parent_inode = &inode_table[parent_inode_num - 1];
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
 
     // find the next available block
     int last_block_idx = -1;
-    for (int i = 0; i < 15; i++) {
+    for (int i = 0; i < EXT2_NDIR_BLOCKS; i++) {
         if (parent_inode->i_block[i] != 0) {
             last_block_idx = i;
             
@@ -527,7 +3206,7 @@ void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, c
 
     int block_num = parent_inode->i_block[last_block_idx];
 
-    char* block_data = (struct ext2_dir_entry *) (disk + block_num * EXT2_BLOCK_SIZE);
+    char* block_data = (char*) (disk + block_num * EXT2_BLOCK_SIZE);
     int used_space = 0;
     int metadata_bytes = 8; // 4 bytes for inode, 2 bytes for rec_len, 1 byte for name_len, 1 byte for file_type
     struct ext2_dir_entry* entry = (struct ext2_dir_entry*) (block_data + used_space);
@@ -546,6 +3225,9 @@ void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, c
                 // entry is not the last dir so rec_len = actual_entry_size
                 used_space += entry->rec_len;
             }
+        } else {
+            // an emptied block (see remove_dir_entry()), reuse the unused entry
+            break;
         }
         entry = (struct ext2_dir_entry*) (block_data + used_space); 
     }
@@ -553,8 +3235,63 @@ void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, c
     // entry is the next available entry in the last used block at this point
     // used space is also the cumulative space used for all previous dir entries in the same block
     entry->inode = new_inode_num;
-    entry->name_len = strlen(dir);
-    strncpy(entry->name, dir, strlen(dir));
+    entry->name_len = dir_len;
+    memcpy(entry->name, dir, dir_len);
     entry->file_type = file_type;
     entry->rec_len = EXT2_BLOCK_SIZE - used_space;
-}
\ No newline at end of file
+    mark_blocks_dirty(block_num, 1);
+
+    dcache_insert(parent_inode_num, dir, entry->name_len, new_inode_num);
+}
+
+bool remove_dir_entry(int parent_inode_num, const char* name, int name_len) {
+    /*
+    Return value interpretation:
+    false: no entry named name in the parent dir
+    true: the entry is gone from the directory block and the dentry cache
+
+    The space goes to the entry in front of it. The first entry of a block has none, so the
+    entry after it moves to the start of the block instead; an entry alone in its block is
+    left unused (inode 0), which has_space_in_parent_last_used_block() and
+    add_dir_entry_to_last_used_block() treat as free space.
+    The caller must hold the write lock of the parent directory.
+    */
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
+    for (int block = 0; block < EXT2_NDIR_BLOCKS; block++) {
+        if (parent_inode->i_block[block] == 0) {
+            continue;
+        }
+        uint32_t block_num = parent_inode->i_block[block];
+        unsigned char* dir_block = disk + (size_t) block_num * EXT2_BLOCK_SIZE;
+        struct ext2_dir_entry* prev = NULL;
+        unsigned int offset = 0;
+        while (offset < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry*) (dir_block + offset);
+            if (dir_entry->rec_len == 0) {
+                break; // corrupted block, do not loop forever
+            }
+            if (dir_entry->inode == 0 || dir_entry->name_len != name_len || memcmp(dir_entry->name, name, name_len) != 0) {
+                prev = dir_entry;
+                offset += dir_entry->rec_len;
+                continue;
+            }
+
+            if (prev != NULL) {
+                prev->rec_len += dir_entry->rec_len;
+            }
+            else if (dir_entry->rec_len < EXT2_BLOCK_SIZE) {
+                struct ext2_dir_entry *next = (struct ext2_dir_entry*) (dir_block + dir_entry->rec_len);
+                unsigned short rec_len = dir_entry->rec_len + next->rec_len;
+                memmove(dir_entry, next, 8 + next->name_len);
+                dir_entry->rec_len = rec_len;
+            }
+            else {
+                dir_entry->inode = 0;
+            }
+            mark_blocks_dirty(block_num, 1);
+            dcache_remove(parent_inode_num, name, name_len);
+            return true;
+        }
+    }
+    return false;
+}
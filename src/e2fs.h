@@ -15,33 +15,127 @@
 #define CSC369_E2FS_H
 
 #include "ext2.h"
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 /**
  * TODO: add in here prototypes for any helpers you might need.
  * Implement the helpers in e2fs.c
  */
-char* get_normalized_path(const char* path);
+struct ext2_inode* get_inode(int inode_num);
+uint32_t inode_group(int inode_num);
 bool is_inode_in_use(int inode_num);
-int find_free_inode();
-int initialize_new_inode(int mode);
-int find_free_block();
+int find_free_inode(int parent_inode_num, bool is_dir);
+int initialize_new_inode(int parent_inode_num, int mode);
+int find_next_zero_bit(const unsigned char* bitmap, uint32_t nbits, uint32_t start);
+int find_free_block(int goal_inode_num);
+int find_free_block_run(int goal_inode_num, int wanted, int* run_len);
 void release_block(int block_num); 
+int find_zeroed_block(int goal_inode_num);
+void start_scrubber();
+void stop_scrubber();
 void release_inode(int inode_num);
+void init_free_counts();
+void sync_free_counts();
+void destroy_free_counts();
+uint32_t read_free_blocks_count();
+uint32_t read_free_inodes_count();
+void set_durability(int mode, uint32_t window_us, uint32_t max_ops);
+void mark_dirty(const void* addr, size_t len);
+void mark_inode_dirty(int inode_num);
+void mark_blocks_dirty(uint32_t first_block, uint32_t count);
+void mark_data_dirty(uint32_t first_block, uint32_t count);
+void mark_file_tables_dirty(struct ext2_inode* inode);
+bool write_image_range(size_t offset, size_t len);
+void begin_op();
+void commit_op();
+void sync_image();
+bool open_journal(const char* path, bool enable);
+void close_journal();
 void clear_inode_data_blocks(int inode_num);
-int validate_path_exists(const char* path);
-void traverse_path(const char* path, int* parent_inode, int* child_inode);
-char* get_path_to_parent(const char* path);
+uint32_t truncate_inode_blocks(struct ext2_inode* inode, uint32_t keep);
+void orphan_inode(int inode_num);
+void drop_link(int inode_num);
+void start_reclaimer();
+void stop_reclaimer();
 
-int get_child_inode_num(int parent_inode_num, const char* child_name);
+// the commands without the begin_op() / commit_op() around them, ext2_fsal_submit_batch()
+// commits once per batch
+int32_t copy_file(const char* src, const char* dst);
+int32_t link_hard(const char* src, const char* dst);
+int32_t link_soft(const char* src, const char* dst);
+int32_t remove_file(const char* path);
+int32_t make_dir(const char* path);
+
+// parallel cp defaults, see struct ext2_fsal_options
+#define CP_DEFAULT_PARALLEL_THRESHOLD (64ULL * 1024 * 1024)
+#define CP_DEFAULT_WORKERS 4
+#define CP_MAX_WORKERS 64
+
+// operations that end a group commit window early, see struct ext2_fsal_options
+#define GROUP_COMMIT_DEFAULT_OPS 32
+
+// once the metadata journal grows past this, the image is written back and the journal emptied
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+// in durability mode NONE, the running transaction is committed once it holds this much
+#define JOURNAL_RUNNING_BYTES (1024 * 1024)
+
+// contiguous runs of free blocks handed out one block at a time, in ascending order
+struct block_supply {
+    int goal_inode_num;     // runs are allocated near this inode
+    uint32_t remaining;     // blocks still expected, the size asked for with the next run
+    uint32_t next;          // next block of the current run
+    uint32_t left;          // blocks left in the current run
+    uint32_t taken;         // blocks handed out so far
+};
+
+int take_supply_block(struct block_supply* supply);
+uint32_t count_file_blocks(uint32_t data_blocks);
+uint32_t* get_block_slot(struct ext2_inode* inode, uint32_t idx, struct block_supply* supply);
+uint32_t get_file_block(struct ext2_inode* inode, uint32_t idx);
+
+// outcome of resolve_path()
+enum path_status {
+    PATH_EXISTS,        // every component of the path exists
+    PATH_MISSING,       // only the last component does not exist
+    PATH_BAD_PREFIX,    // an intermediate folder does not exist or exists as a file
+    PATH_NAME_TOO_LONG  // the missing last component is longer than EXT2_NAME_LEN
+};
+
+struct path_lookup {
+    enum path_status status;
+    int parent_inode_num;   // directory holding the last component
+    int child_inode_num;    // inode of the last component, -1 if it does not exist
+    const char* name;       // last component, points into the resolved path
+    int name_len;           // length of name, the name is not zero terminated
+    int locked_inode_num;   // directory still locked by the lookup, 0 once released
+};
+
+void lock_inode(int inode_num, bool for_write);
+void unlock_inode(int inode_num);
+void pin_inode_views(int inode_num);
+void unpin_inode_views(int inode_num);
+void wait_for_inode_views(int inode_num);
+void resolve_path(const char* path, struct path_lookup* lookup, bool write_parent);
+void hold_child_dir(struct path_lookup* lookup);
+void hold_child_for_read(struct path_lookup* lookup);
+void release_path(struct path_lookup* lookup);
+
+int dcache_lookup(int parent_inode_num, const char* name, int name_len);
+void dcache_insert(int parent_inode_num, const char* name, int name_len, int child_inode_num);
+void dcache_remove(int parent_inode_num, const char* name, int name_len);
+void dcache_forget_dir(int dir_inode_num);
+void dcache_destroy();
+int get_child_inode_num(int parent_inode_num, const char* child_name, int child_name_len);
 bool is_inode_to_dir(int inode_num);
 bool is_inode_to_file(int inode_num);
 bool is_inode_to_symlink(int inode_num);
 
-bool has_space_in_parent_last_used_block(int parent_inode_num, const char* new_dir_name);
+bool has_space_in_parent_last_used_block(int parent_inode_num, int name_len);
 int allocate_new_block_for_parent(int parent_inode_num);
-void add_dir_entry_to_new_block(int parent_inode_num, int new_inode_num, char* dir, int new_block, int file_type);
-void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, char* dir, int file_type);
+void add_dir_entry_to_new_block(int parent_inode_num, int new_inode_num, const char* dir, int dir_len, int new_block, int file_type);
+void add_dir_entry_to_last_used_block(int parent_inode_num, int new_inode_num, const char* dir, int dir_len, int file_type);
+bool remove_dir_entry(int parent_inode_num, const char* name, int name_len);
 
 
 #endif
\ No newline at end of file
@@ -22,6 +22,16 @@
 /* The ext2 block size used in the assignment. */
 #define EXT2_BLOCK_SIZE 1024
 
+/* Layout of i_block[]: direct blocks, then single, double and triple indirect tables. */
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS
+#define EXT2_DIND_BLOCK  (EXT2_IND_BLOCK + 1)
+#define EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK + 1)
+#define EXT2_N_BLOCKS    (EXT2_TIND_BLOCK + 1)
+
+/* Value of s_magic in every ext2 super block. */
+#define EXT2_SUPER_MAGIC 0xEF53
+
 /*
  * Structure of the super block
  */
@@ -145,7 +155,7 @@ struct ext2_inode {
 	unsigned int   i_flags;       /* File flags */
 	/* You should set it to 0. */
 	unsigned int   osd1;          /* OS dependent 1 */
-	unsigned int   i_block[15];   /* Pointers to blocks */
+	unsigned int   i_block[15];   /* Pointers to blocks, see EXT2_N_BLOCKS */
 	/* You should use generation number 0 for the assignment. */
 	unsigned int   i_generation;  /* File version (for NFS) */
 	/* The following fields should be 0 for the assignment.  */
@@ -159,6 +169,7 @@ struct ext2_inode {
 /*
  * Type field for file mode
  */
+#define    EXT2_S_IFMT   0xF000    /* mask for the type bits */
 #define    EXT2_S_IFLNK  0xA000    /* symbolic link */
 #define    EXT2_S_IFREG  0x8000    /* regular file */
 #define    EXT2_S_IFDIR  0x4000    /* directory */
@@ -21,46 +21,268 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <string.h>
+#include <errno.h>
 
 unsigned char *disk;
+size_t disk_size;
+int image_fd = -1;
+bool image_private;
+bool cp_use_copy_file_range;
+uint64_t cp_parallel_threshold;
+uint32_t cp_workers;
 struct ext2_super_block *sb;
 struct ext2_group_desc *gd;
-unsigned char *block_bitmap;
-unsigned char* inode_bitmap;
-struct ext2_inode *inode_table;
-pthread_mutex_t inode_bitmap_lock;
-pthread_mutex_t datablock_bitmap_lock;
+uint32_t group_count;
 pthread_mutex_t superblock_lock;
 pthread_mutex_t group_desc_lock;
+pthread_rwlock_t *inode_locks;
+uint32_t *inode_view_pins;
 
 
 
+static size_t get_image_size(int fd) {
+    /* Return value interpretation:
+     * 0 -> the file is not a usable ext2 image
+     * otherwise -> number of bytes covered by the file system (s_blocks_count blocks)
+     */
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return 0;
+    }
+
+    // peek at the super block before mapping anything
+    struct ext2_super_block super;
+    if (pread(fd, &super, sizeof(super), EXT2_BLOCK_SIZE) != sizeof(super)) {
+        fprintf(stderr, "ext2_fsal_init: image too small for a super block\n");
+        return 0;
+    }
+    if (super.s_magic != EXT2_SUPER_MAGIC || super.s_log_block_size != 0) {
+        fprintf(stderr, "ext2_fsal_init: not an ext2 image with %d byte blocks\n", EXT2_BLOCK_SIZE);
+        return 0;
+    }
+
+    // each group's bitmaps must fit in one block, inodes must hold at least struct ext2_inode
+    if (super.s_blocks_per_group == 0 || super.s_blocks_per_group > EXT2_BLOCK_SIZE * 8
+        || super.s_inodes_per_group == 0 || super.s_inodes_per_group > EXT2_BLOCK_SIZE * 8
+        || (super.s_rev_level > 0 && super.s_inode_size < sizeof(struct ext2_inode))) {
+        fprintf(stderr, "ext2_fsal_init: unsupported group geometry\n");
+        return 0;
+    }
+
+    size_t size = (size_t) super.s_blocks_count * EXT2_BLOCK_SIZE;
+    if ((off_t) size > st.st_size) {
+        fprintf(stderr, "ext2_fsal_init: image is truncated (%zu bytes expected, %lld found)\n",
+                size, (long long) st.st_size);
+        return 0;
+    }
+    return size;
+}
+
+static void read_options_from_env(struct ext2_fsal_options* options) {
+    memset(options, 0, sizeof(struct ext2_fsal_options));
+
+    const char* value = getenv("EXT2FSAL_MAP_POPULATE");
+    options->map_populate = value != NULL && strcmp(value, "1") == 0;
+
+    value = getenv("EXT2FSAL_MADVISE");
+    if (value != NULL) {
+        if (strcmp(value, "willneed") == 0) {
+            options->map_advice = EXT2_FSAL_ADVICE_WILLNEED;
+        } else if (strcmp(value, "sequential") == 0) {
+            options->map_advice = EXT2_FSAL_ADVICE_SEQUENTIAL;
+        } else if (strcmp(value, "random") == 0) {
+            options->map_advice = EXT2_FSAL_ADVICE_RANDOM;
+        }
+    }
+
+    value = getenv("EXT2FSAL_HUGE_PAGES");
+    options->huge_pages = value != NULL && strcmp(value, "1") == 0;
+
+    value = getenv("EXT2FSAL_COPY_FILE_RANGE");
+    options->no_copy_file_range = value != NULL && strcmp(value, "0") == 0;
+
+    value = getenv("EXT2FSAL_CP_PARALLEL_THRESHOLD");
+    if (value != NULL) {
+        options->cp_parallel_threshold = strtoull(value, NULL, 10);
+    }
+
+    value = getenv("EXT2FSAL_CP_WORKERS");
+    if (value != NULL) {
+        options->cp_workers = strtoul(value, NULL, 10);
+    }
+
+    value = getenv("EXT2FSAL_DURABILITY");
+    if (value != NULL) {
+        if (strcmp(value, "op") == 0) {
+            options->durability = EXT2_FSAL_DURABILITY_PER_OP;
+        } else if (strcmp(value, "group") == 0) {
+            options->durability = EXT2_FSAL_DURABILITY_GROUP;
+        }
+    }
+
+    value = getenv("EXT2FSAL_GROUP_COMMIT_US");
+    if (value != NULL) {
+        options->group_commit_us = strtoul(value, NULL, 10);
+    }
+
+    value = getenv("EXT2FSAL_GROUP_COMMIT_OPS");
+    if (value != NULL) {
+        options->group_commit_ops = strtoul(value, NULL, 10);
+    }
+
+    value = getenv("EXT2FSAL_JOURNAL");
+    options->journal = value != NULL && strcmp(value, "1") == 0;
+
+    options->journal_path = getenv("EXT2FSAL_JOURNAL_PATH");
+
+    value = getenv("EXT2FSAL_LAZY_ZERO");
+    options->lazy_zeroing = value != NULL && strcmp(value, "1") == 0;
+}
+
+static void advise_mapping(const struct ext2_fsal_options* options) {
+    // hints only, a kernel without support for one of them still serves the image
+    int advice = -1;
+    switch (options->map_advice) {
+    case EXT2_FSAL_ADVICE_WILLNEED:
+        advice = MADV_WILLNEED;
+        break;
+    case EXT2_FSAL_ADVICE_SEQUENTIAL:
+        advice = MADV_SEQUENTIAL;
+        break;
+    case EXT2_FSAL_ADVICE_RANDOM:
+        advice = MADV_RANDOM;
+        break;
+    case EXT2_FSAL_ADVICE_NONE:
+        break;
+    }
+    if (advice != -1 && madvise(disk, disk_size, advice) == -1) {
+        perror("madvise");
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (options->huge_pages && madvise(disk, disk_size, MADV_HUGEPAGE) == -1) {
+        perror("madvise(MADV_HUGEPAGE)");
+    }
+#endif
+}
+
 void ext2_fsal_init(const char* image)
+{
+    struct ext2_fsal_options options;
+    read_options_from_env(&options);
+    ext2_fsal_init_with_options(image, &options);
+}
+
+void ext2_fsal_init_with_options(const char* image, const struct ext2_fsal_options* options)
 {
     /**
      * TODO: Initialization tasks, e.g., initialize synchronization primitives used,
      * or any other structures that may need to be initialized in your implementation,
      * open the disk image by mmap-ing it, etc.
      */
+    struct ext2_fsal_options defaults;
+    if (options == NULL) {
+        memset(&defaults, 0, sizeof(defaults));
+        options = &defaults;
+    }
+
     int fd = open(image, O_RDWR);
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    // map exactly the blocks the file system covers
+    disk_size = get_image_size(fd);
+    if (disk_size == 0) {
+        close(fd);
+        exit(1);
+    }
+
+    // with the journal on, metadata must only reach the image at checkpoints, see open_journal()
+    image_private = options->journal;
+    int flags = image_private ? MAP_PRIVATE : MAP_SHARED;
+    if (options->map_populate) {
+        flags |= MAP_POPULATE;
+    }
+    disk = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, flags, fd, 0);
     if (disk == MAP_FAILED) {
         perror("mmap");
         exit(1);
     }
+    // kept open so cp can copy_file_range() into the image (or write the data of a private
+    // mapping through to it), see ext2fsal_cp.c
+    image_fd = fd;
+    cp_use_copy_file_range = !options->no_copy_file_range;
+    cp_parallel_threshold = (options->cp_parallel_threshold != 0) ? options->cp_parallel_threshold : CP_DEFAULT_PARALLEL_THRESHOLD;
+    cp_workers = (options->cp_workers != 0) ? options->cp_workers : CP_DEFAULT_WORKERS;
+    if (cp_workers > CP_MAX_WORKERS) {
+        cp_workers = CP_MAX_WORKERS;
+    }
+
+    advise_mapping(options);
 
     sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-    gd = (struct ext2_group_desc *) (disk + 2 * EXT2_BLOCK_SIZE);
-    block_bitmap = (unsigned char*) (disk + gd->bg_block_bitmap * EXT2_BLOCK_SIZE);
-    inode_bitmap = (unsigned char*) (disk + gd->bg_inode_bitmap * EXT2_BLOCK_SIZE);
-    inode_table = (struct ext2_inode *) (disk + gd->bg_inode_table * EXT2_BLOCK_SIZE);
+    // the group descriptor table starts in the block after the super block,
+    // get_inode() and the allocators in e2fs.c find each group's bitmaps and inodes through it
+    gd = (struct ext2_group_desc *) (disk + (sb->s_first_data_block + 1) * EXT2_BLOCK_SIZE);
+    group_count = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
 
     // initialize sync locks
-    pthread_mutex_init(&inode_bitmap_lock, NULL);
-    pthread_mutex_init(&datablock_bitmap_lock, NULL);
     pthread_mutex_init(&superblock_lock, NULL);
     pthread_mutex_init(&group_desc_lock, NULL);
 
+    // finish the operations a crashed run committed to the journal, then journal from now on
+    char* journal_path = NULL;
+    if (options->journal_path == NULL) {
+        journal_path = malloc(strlen(image) + sizeof(".journal"));
+        if (journal_path == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        strcpy(journal_path, image);
+        strcat(journal_path, ".journal");
+    }
+    if (!open_journal(options->journal_path != NULL ? options->journal_path : journal_path, options->journal)) {
+        exit(1);
+    }
+    free(journal_path);
+
+    // free counts are batched per thread from now on
+    init_free_counts();
+
+    ext2_fsal_set_durability(options->durability, options->group_commit_us, options->group_commit_ops);
+
+    if (options->lazy_zeroing) {
+        start_scrubber();
+    }
+
+    // one reader/writer lock per inode, see lock_inode() for the lock order
+    inode_locks = malloc(sb->s_inodes_count * sizeof(pthread_rwlock_t));
+    if (inode_locks == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < sb->s_inodes_count; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    // views of ext2_fsal_read() still held per inode, see pin_inode_views()
+    inode_view_pins = calloc(sb->s_inodes_count, sizeof(uint32_t));
+    if (inode_view_pins == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // files removed before a crash still have blocks to give back
+    start_reclaimer();
+
+}
+
+void ext2_fsal_set_durability(enum ext2_fsal_durability mode, uint32_t group_commit_us, uint32_t group_commit_ops)
+{
+    set_durability(mode, group_commit_us, (group_commit_ops != 0) ? group_commit_ops : GROUP_COMMIT_DEFAULT_OPS);
 }
 
 void ext2_fsal_destroy()
@@ -69,12 +291,78 @@ void ext2_fsal_destroy()
      * TODO: Cleanup tasks, e.g., destroy synchronization primitives, munmap the image, etc.
      */
 
+    // the orphans still queued are reclaimed before the image goes away
+    stop_reclaimer();
+
+    // no more background zeroing, the scrubber hands back any blocks it holds first
+    stop_scrubber();
+
+    // with durability on, everything must be in the file before the mapping goes away;
+    // closing the journal commits the last transaction, which may free blocks, writes the
+    // image back and empties the journal
+    close_journal();
+
+    // write back the free counts still batched in per-thread deltas
+    destroy_free_counts();
+    sync_image();
+
     // clean up sync locks
-    pthread_mutex_destroy(&inode_bitmap_lock);
-    pthread_mutex_destroy(&datablock_bitmap_lock);
     pthread_mutex_destroy(&superblock_lock);
     pthread_mutex_destroy(&group_desc_lock);
+    for (uint32_t i = 0; i < sb->s_inodes_count; i++) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+    }
+    free(inode_locks);
+    free(inode_view_pins);
+
+    // drop cached directory entries
+    dcache_destroy();
 
     // munmap disk image
-    munmap(disk, 128 * 1024);
-}
\ No newline at end of file
+    munmap(disk, disk_size);
+    close(image_fd);
+    image_fd = -1;
+}
+
+int32_t ext2_fsal_submit_batch(const struct ext2_fsal_op* ops, uint32_t n, int32_t* results)
+{
+    // Directory locks are still taken and dropped per operation: holding them across the
+    // batch would stall other clients and could invert the lock order between operations.
+    // Paths sharing a prefix resolve through the dentry cache, and the free counts are
+    // batched per thread anyway, so what the batch saves is the commit of every operation.
+    begin_op();
+    int32_t first_error = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        int32_t res;
+        switch (ops[i].type) {
+        case EXT2_FSAL_OP_CP:
+            res = copy_file(ops[i].src, ops[i].dst);
+            break;
+        case EXT2_FSAL_OP_LN_HL:
+            res = link_hard(ops[i].src, ops[i].dst);
+            break;
+        case EXT2_FSAL_OP_LN_SL:
+            res = link_soft(ops[i].src, ops[i].dst);
+            break;
+        case EXT2_FSAL_OP_RM:
+            res = remove_file(ops[i].src);
+            break;
+        case EXT2_FSAL_OP_MKDIR:
+            res = make_dir(ops[i].src);
+            break;
+        default:
+            res = EINVAL;
+            break;
+        }
+        if (results != NULL) {
+            results[i] = res;
+        }
+        if (res != 0 && first_error == 0) {
+            first_error = res;
+        }
+    }
+
+    // one commit for the whole batch, with no lock held
+    commit_op();
+    return first_error;
+}
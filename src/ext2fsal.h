@@ -15,13 +15,110 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Access pattern hint given to madvise() for the whole image mapping
+enum ext2_fsal_map_advice {
+    EXT2_FSAL_ADVICE_NONE,
+    EXT2_FSAL_ADVICE_WILLNEED,
+    EXT2_FSAL_ADVICE_SEQUENTIAL,
+    EXT2_FSAL_ADVICE_RANDOM
+};
+
+// When changes to the image reach the image file, see ext2_fsal_set_durability()
+enum ext2_fsal_durability {
+    EXT2_FSAL_DURABILITY_NONE,      // whenever the kernel writes the dirty pages back
+    EXT2_FSAL_DURABILITY_PER_OP,    // before each operation returns, one msync per operation
+    EXT2_FSAL_DURABILITY_GROUP      // operations finishing close together share one msync
+};
+
+// One operation of ext2_fsal_submit_batch()
+enum ext2_fsal_op_type {
+    EXT2_FSAL_OP_CP,
+    EXT2_FSAL_OP_LN_HL,
+    EXT2_FSAL_OP_LN_SL,
+    EXT2_FSAL_OP_RM,
+    EXT2_FSAL_OP_MKDIR
+};
+
+struct ext2_fsal_op {
+    enum ext2_fsal_op_type type;
+    const char *src;    // the path of rm and mkdir
+    const char *dst;    // unused by rm and mkdir
+};
+
+// Result of ext2_fsal_stat()
+struct ext2_fsal_stat {
+    uint32_t ino;
+    uint16_t mode;      // type and permission bits, EXT2_S_IF* in ext2.h
+    uint16_t links;
+    uint64_t size;
+    uint64_t blocks;    // 512-byte sectors, indirect tables included
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+};
+
+// One record of the pages filled by ext2_fsal_readdir(), laid out like an on-disk entry
+struct ext2_fsal_dirent {
+    uint32_t ino;
+    uint16_t rec_len;   // bytes from this record to the next one, a multiple of 8
+    uint8_t name_len;
+    uint8_t file_type;  // EXT2_FT_* in ext2.h
+    char name[];        // name_len bytes and a terminating zero
+};
+
+// Tunables for ext2_fsal_init_with_options()
+struct ext2_fsal_options {
+    // prefault the whole image at startup (MAP_POPULATE) instead of on first touch
+    bool map_populate;
+    // madvise() hint for the mapping
+    enum ext2_fsal_map_advice map_advice;
+    // ask for transparent huge pages on the mapping (MADV_HUGEPAGE)
+    bool huge_pages;
+    // cp always reads the source into the mapping instead of trying copy_file_range()
+    bool no_copy_file_range;
+    // sources of at least this many bytes are copied by several threads (0: 64 MiB)
+    uint64_t cp_parallel_threshold;
+    // number of threads copying one large source (0: 4, 1: never copy in parallel)
+    uint32_t cp_workers;
+    // durability mode and, for group commit, how long a commit waits for other operations
+    // to join (0: no wait, operations finishing during a commit join the next one) and how
+    // many operations end the wait early (0: 32)
+    enum ext2_fsal_durability durability;
+    uint32_t group_commit_us;
+    uint32_t group_commit_ops;
+    // log metadata changes to a redo journal and commit them there instead of writing them
+    // in place, see open_journal() in e2fs.c; the journal is image + ".journal" unless
+    // journal_path is set. A journal left behind by a crash is replayed whether or not
+    // journaling is on.
+    bool journal;
+    const char* journal_path;
+    // freed blocks are zeroed (or punched out of the image file) later by a background thread
+    // at idle priority, instead of with a memset when they are freed
+    bool lazy_zeroing;
+};
 
 // Initializes the ext2 file system
 // Called only once during the server initialization
 //
 // image is a pointer to a zero terminated string that is a full path to valid ext2 disk image
+//
+// The mapping options are read from the environment:
+//   EXT2FSAL_MAP_POPULATE=1, EXT2FSAL_MADVISE=willneed|sequential|random, EXT2FSAL_HUGE_PAGES=1,
+//   EXT2FSAL_COPY_FILE_RANGE=0, EXT2FSAL_CP_PARALLEL_THRESHOLD=<bytes>, EXT2FSAL_CP_WORKERS=<n>,
+//   EXT2FSAL_DURABILITY=none|op|group, EXT2FSAL_GROUP_COMMIT_US=<us>, EXT2FSAL_GROUP_COMMIT_OPS=<n>,
+//   EXT2FSAL_JOURNAL=1, EXT2FSAL_JOURNAL_PATH=<path>, EXT2FSAL_LAZY_ZERO=1
 void ext2_fsal_init(const char *image);
 
+// Same as ext2_fsal_init(), with explicit options (NULL means all defaults)
+void ext2_fsal_init_with_options(const char *image, const struct ext2_fsal_options *options);
+
+// Changes the durability mode at run time, e.g. from the server's sync mode controls;
+// operations already running finish under the mode they started with
+void ext2_fsal_set_durability(enum ext2_fsal_durability mode, uint32_t group_commit_us, uint32_t group_commit_ops);
+
 // Destroys the ext2 file system
 void ext2_fsal_destroy();
 
@@ -60,3 +157,61 @@ int32_t ext2_fsal_rm(const char *path);
 // returns 0 if the operation completed succefully. 
 // Otherwise, an error may be returned (see handout).
 int32_t ext2_fsal_mkdir(const char *path);
+
+// Runs n operations in order, as if each one was called on its own, with a single
+// durability commit at the end: with durability on, all of them are durable once the call
+// returns, and with the journal they commit as one transaction.
+// results, if not NULL, receives the result of each operation (EINVAL for an unknown type).
+// A batch is not atomic. Each operation takes and drops its own locks like a call of its
+// own, so other clients may see (and change) the image between two operations of a batch.
+// An operation that fails leaves the image as the same call on its own would, and neither
+// stops nor undoes the others: the operations after it still run (and fail in turn if they
+// needed it, e.g. a cp into the directory of a failed mkdir), and the ones that succeeded
+// are committed with the batch. There is no all-or-nothing mode; a caller needing one has
+// to check results and undo the operations that succeeded itself.
+//
+// returns 0 if every operation completed successfully,
+// otherwise the error of the first one that failed.
+int32_t ext2_fsal_submit_batch(const struct ext2_fsal_op *ops, uint32_t n, int32_t *results);
+
+// The read side: paths are not followed through symbolic links, a symbolic link is reported
+// (and read) as itself. Nothing here is made durable or takes part in a batch.
+
+// path is a pointer to a zero terminated string
+//
+// returns 0 and fills *st if the operation completed succefully,
+// otherwise ENOENT.
+int32_t ext2_fsal_stat(const char *path, struct ext2_fsal_stat *st);
+
+// Fills buf with as many whole ext2_fsal_dirent records of the directory path as fit in
+// len bytes, starting at *cursor, and sets *filled to the number of bytes used.
+// *cursor starts at 0 and is moved past the returned records, the end of the directory
+// is reached once a call fills 0 bytes. The listing is not a snapshot: changes to the
+// directory between calls may make entries be missed, but no entry is returned twice.
+//
+// returns 0 if the operation completed succefully,
+// ENOENT for a missing path, ENOTDIR if path is not a directory,
+// EINVAL if len is too small for the next record.
+int32_t ext2_fsal_readdir(const char *path, uint64_t *cursor, void *buf, size_t len, size_t *filled);
+
+// Describes up to len bytes of the file (or symbolic link target) at path, starting at
+// offset, with at most *iovcnt entries of iov that point straight into the mapped image;
+// contiguous blocks share one entry and holes point at a shared block of zeros.
+// *iovcnt is set to the entries used and *bytes to the bytes they cover, which is less than
+// len at the end of the file or when iov ran out of entries.
+// Whenever the call returns 0, *view receives a handle that pins the file (even if offset is
+// past its end) and must be passed to ext2_fsal_read_release(), from any thread; on an
+// error *view is set to 0, which ext2_fsal_read_release() ignores. Until the release, the
+// entries keep showing the content the file had, since a cp over the file, and the release
+// of its blocks once it is removed, wait for every view of it. Views are meant to be
+// short-lived: a cp waiting for one holds its locks, and with the journal on the commit of
+// every operation, meanwhile. A thread must not change a file it holds a view of, and every
+// view has to be released before ext2_fsal_destroy().
+//
+// returns 0 if the operation completed succefully,
+// ENOENT for a missing path, EISDIR for a directory, EINVAL if *iovcnt is 0.
+int32_t ext2_fsal_read(const char *path, uint64_t offset, uint64_t len,
+                       struct iovec *iov, int *iovcnt, uint64_t *bytes, uint32_t *view);
+
+// Releases a view returned by ext2_fsal_read(), its entries must not be used any more.
+void ext2_fsal_read_release(uint32_t view);
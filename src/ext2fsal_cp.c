@@ -11,6 +11,7 @@
  * -------------
  */
 
+#define _GNU_SOURCE // copy_file_range()
 #include "ext2fsal.h"
 #include "e2fs.h"
 
@@ -19,293 +20,384 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
 extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char* inode_bitmap;
-extern struct ext2_inode *inode_table;
-extern pthread_mutex_t inode_bitmap_lock;
-extern pthread_mutex_t datablock_bitmap_lock;
 extern pthread_mutex_t superblock_lock;
 extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
+extern int image_fd;
+extern bool image_private;
+extern bool cp_use_copy_file_range;
+extern uint64_t cp_parallel_threshold;
+extern uint32_t cp_workers;
+
+// largest file i_size can describe
+#define CP_MAX_FILE_SIZE 0xFFFFFFFFL
+
+static int handle_failed_copy(int inode_num, bool is_new_file, int src_fd, int err) {
+    // release everything allocated for the copy so far; an existing file is still linked from
+    // its directory entries (maybe several, through hard links), so it is kept, truncated to 0
+    clear_inode_data_blocks(inode_num);
+    if (is_new_file) {
+        release_inode(inode_num);
+    }
+    else {
+        mark_inode_dirty(inode_num);
+    }
+    close(src_fd);
+    return err;
+}
 
-int copy_file_to_parent_dir(int parent_inode_num, int new_inode_num, FILE* src_file) {
-    // copy data from src file to data blocks
-
-    // get size of src file first
-    fseek(src_file, 0, SEEK_END);
-    long src_size = ftell(src_file);
-    fseek(src_file, 0, SEEK_SET);
-
-    int blocks_needed = (src_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE; // round up number of blocks
-
-    // allocate data blocks and copy data
-    struct ext2_inode* inode = &inode_table[new_inode_num - 1];
-    size_t bytes_written = 0;
-
-    for (int i = 0; i < blocks_needed && i < 14; i++) {
-        // allocate a data block
-        int block_num = find_free_block();
-        if (block_num == -1) {
-            // no free blocks left
-            clear_inode_data_blocks(new_inode_num);
-            release_inode(new_inode_num);
-            fclose(src_file);
-            return ENOSPC;
+static int copy_into_blocks(int src_fd, off_t src_offset, uint32_t first_block, size_t len) {
+    /*
+    Copy len bytes of src_fd starting at src_offset into consecutive blocks starting at first_block.
+    Return value interpretation:
+    -1: reading the source failed
+    0: done
+
+    The kernel copies page cache to page cache with copy_file_range(), which the shared
+    mapping of the image sees right away. Where that is not supported the source is
+    pread() straight into the mapped blocks, still one call per contiguous range.
+    A private mapping (journal on) only sees the file where this process never wrote, so the
+    data is read into the mapping and written through to the file, after which the pages it
+    covers entirely are dropped from the mapping and read from the file again.
+    The last block is zeroed past len.
+    */
+    off_t dst_offset = (off_t) first_block * EXT2_BLOCK_SIZE;
+    size_t done = 0;
+    while (done < len && !image_private && __atomic_load_n(&cp_use_copy_file_range, __ATOMIC_RELAXED)) {
+        loff_t in_offset = src_offset + done;
+        loff_t out_offset = dst_offset + done;
+        ssize_t copied = copy_file_range(src_fd, &in_offset, image_fd, &out_offset, len - done, 0);
+        if (copied > 0) {
+            done += copied;
         }
+        else if (copied == 0) {
+            return -1; // the source is shorter than it was when the copy started
+        }
+        else if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP) {
+            // not supported between these files systems, stop trying for good
+            __atomic_store_n(&cp_use_copy_file_range, false, __ATOMIC_RELAXED);
+        }
+        else if (errno == EINVAL) {
+            break; // not supported for this source, e.g. a pipe
+        }
+        else if (errno != EINTR) {
+            return -1;
+        }
+    }
 
-        // set block pointer in inode
-        inode->i_block[i] = block_num;
-
-        // copy data to this block
-        size_t bytes_to_copy = (src_size - bytes_written > EXT2_BLOCK_SIZE) ? EXT2_BLOCK_SIZE : (src_size - bytes_written);
+    unsigned char* block_ptr = disk + dst_offset;
+    while (done < len) {
+        ssize_t bytes_read = pread(src_fd, block_ptr + done, len - done, src_offset + done);
+        if (bytes_read > 0) {
+            done += bytes_read;
+        }
+        else if (bytes_read == 0 || errno != EINTR) {
+            return -1;
+        }
+    }
 
-        // get pointer to the data block
-        unsigned char* block_ptr = disk + (block_num * EXT2_BLOCK_SIZE);
+    // the rest of the last block may still hold what a deleted file left there, since with
+    // lazy zeroing freed blocks can be handed out again before the scrubber got to them
+    size_t blocks_len = (len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE * EXT2_BLOCK_SIZE;
+    memset(block_ptr + len, 0, blocks_len - len);
 
-        // read bytes_to_copy bytes from src_file to block_ptr
-        // fread() will automatically increment the file descriptor src_file
-        size_t bytes_read = fread(block_ptr, 1, bytes_to_copy, src_file);
+    if (image_private) {
+        if (!write_image_range(dst_offset, blocks_len)) {
+            return -1;
+        }
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t first_page = ((size_t) dst_offset + page_size - 1) & ~(page_size - 1);
+        size_t end_page = ((size_t) dst_offset + blocks_len) & ~(page_size - 1);
+        if (first_page < end_page) {
+            madvise(disk + first_page, end_page - first_page, MADV_DONTNEED);
+        }
+    }
+    return 0;
+}
 
-        if (bytes_read != bytes_to_copy) {
-            // error reading from src file
-            fclose(src_file);
-            clear_inode_data_blocks(new_inode_num);
-            release_inode(new_inode_num);
-            
-            return EIO; // I/O error
+static int copy_file_blocks(int src_fd, struct ext2_inode* inode, uint32_t first_idx, uint32_t end_idx, off_t src_size) {
+    // copy logical blocks [first_idx, end_idx) of the source into the blocks already mapped
+    // for them, one call per physically contiguous range; -1 if reading the source failed
+    uint32_t i = first_idx;
+    while (i < end_idx) {
+        uint32_t range_start = get_file_block(inode, i);
+        uint32_t range_len = 1;
+        while (i + range_len < end_idx && get_file_block(inode, i + range_len) == range_start + range_len) {
+            range_len++;
         }
 
-        bytes_written += bytes_to_copy;   
+        off_t src_offset = (off_t) i * EXT2_BLOCK_SIZE;
+        size_t bytes_to_copy = (size_t) range_len * EXT2_BLOCK_SIZE;
+        if (bytes_to_copy > (size_t) (src_size - src_offset)) {
+            bytes_to_copy = src_size - src_offset;
+        }
+        if (copy_into_blocks(src_fd, src_offset, range_start, bytes_to_copy) != 0) {
+            return -1;
+        }
+        i += range_len;
     }
+    return 0;
+}
+
+// one slice of a parallel copy
+struct copy_chunk {
+    int src_fd;
+    struct ext2_inode* inode;
+    uint32_t first_idx;
+    uint32_t end_idx;
+    off_t src_size;
+    int res;
+};
+
+static void* copy_chunk_worker(void* arg) {
+    struct copy_chunk* chunk = arg;
+    chunk->res = copy_file_blocks(chunk->src_fd, chunk->inode, chunk->first_idx, chunk->end_idx, chunk->src_size);
+    return NULL;
+}
 
-    if (bytes_written < src_size) {
-        // direct pointers are not enough to copy the src file
-        // use the indirect pointer
+static int copy_file_blocks_parallel(int src_fd, struct ext2_inode* inode, uint32_t data_blocks, off_t src_size) {
+    /*
+    Split the copy into cp_workers slices, each copied by a thread of its own. Slices are
+    whole indirect tables wide, so each one still copies long contiguous ranges. The calling
+    thread copies the first slice itself. Returns -1 if any slice failed.
+    */
+    struct copy_chunk chunks[CP_MAX_WORKERS];
+    pthread_t threads[CP_MAX_WORKERS];
+    bool started[CP_MAX_WORKERS];
+    uint32_t per_table = EXT2_BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t chunk_blocks = (data_blocks / cp_workers + per_table - 1) / per_table * per_table;
+
+    uint32_t nchunks = 0;
+    for (uint32_t first = 0; first < data_blocks && nchunks < cp_workers; first += chunk_blocks, nchunks++) {
+        struct copy_chunk* chunk = &chunks[nchunks];
+        chunk->src_fd = src_fd;
+        chunk->inode = inode;
+        chunk->first_idx = first;
+        chunk->end_idx = (nchunks == cp_workers - 1 || data_blocks - first < chunk_blocks) ? data_blocks : first + chunk_blocks;
+        chunk->src_size = src_size;
+        chunk->res = 0;
+        // a slice whose thread cannot be started is copied by the caller below
+        started[nchunks] = nchunks > 0 && pthread_create(&threads[nchunks], NULL, copy_chunk_worker, chunk) == 0;
+    }
 
-        int indirect_block_num = find_free_block();
-        if (indirect_block_num == -1) {
-            fclose(src_file);
-            clear_inode_data_blocks(new_inode_num);
-            release_inode(new_inode_num);
-            return ENOSPC;
+    int res = 0;
+    for (uint32_t i = 0; i < nchunks; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        else {
+            copy_chunk_worker(&chunks[i]);
+        }
+        if (chunks[i].res != 0) {
+            res = -1;
         }
+    }
+    return res;
+}
 
-        inode->i_block[14] = indirect_block_num;
-        uint32_t* indirect_table = disk + indirect_block_num * EXT2_BLOCK_SIZE;
-
-        size_t bytes_needed = src_size - bytes_written;
-        int blocks_needed = (bytes_needed + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
-        int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(uint32_t);
-
-        for (int i = 0; i < blocks_needed && i < max_indirect_blocks; i++) {
-            int block_num = find_free_block();
-            if (block_num == -1) {
-                // no space avaialble
-                clear_inode_data_blocks(new_inode_num);
-                release_inode(new_inode_num);
-                fclose(src_file);
-                return ENOSPC;
-            }
+int copy_file_to_parent_dir(int parent_inode_num, int new_inode_num, bool is_new_file, int src_fd) {
+    // copy data from src file to data blocks, is_new_file tells a new inode from an overwritten one
 
-            indirect_table[i] = block_num;
-
-            // get pointer to block
-            unsigned char* block_ptr = disk + (block_num * EXT2_BLOCK_SIZE);
-            size_t bytes_to_copy = (src_size - bytes_written > EXT2_BLOCK_SIZE) ? EXT2_BLOCK_SIZE : (src_size - bytes_written);
-            size_t bytes_read = fread(block_ptr, 1, bytes_to_copy, src_file);
-            if (bytes_read != bytes_to_copy) {
-                // I/O error
-                clear_inode_data_blocks(new_inode_num);
-                release_inode(new_inode_num);
-                fclose(src_file);
-                return EIO;
-            }
+    // get size of src file first
+    struct stat src_stat;
+    if (fstat(src_fd, &src_stat) == -1) {
+        return handle_failed_copy(new_inode_num, is_new_file, src_fd, EIO);
+    }
+    off_t src_size = src_stat.st_size;
+    if (src_size > CP_MAX_FILE_SIZE) {
+        return handle_failed_copy(new_inode_num, is_new_file, src_fd, EFBIG);
+    }
 
-            bytes_written += bytes_to_copy;
+    uint32_t data_blocks = (src_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE; // round up number of blocks
+    struct ext2_inode* inode = get_inode(new_inode_num);
+
+    // Map every block up front, from as few contiguous runs as the bitmap allows, indirect
+    // tables included. Each table is taken right before the first data block it maps, so the
+    // file is laid out in one ascending sequence: d0 .. d11, IND, d12 .. d267, DIND, IND, d268 ..
+    struct block_supply supply = { new_inode_num, count_file_blocks(data_blocks), 0, 0, 0 };
+    for (uint32_t i = 0; i < data_blocks; i++) {
+        // hook blocks into the inode right away so a failure can release them
+        uint32_t* slot = get_block_slot(inode, i, &supply);
+        int block_num = (slot == NULL) ? -1 : take_supply_block(&supply);
+        if (block_num == -1) {
+            // no free blocks left
+            return handle_failed_copy(new_inode_num, is_new_file, src_fd, ENOSPC);
         }
+        *slot = block_num;
+    }
+
+    // the block map is final, so large sources can be copied by several threads at once
+    int res;
+    if (cp_workers > 1 && (uint64_t) src_size >= cp_parallel_threshold) {
+        res = copy_file_blocks_parallel(src_fd, inode, data_blocks, src_size);
+    }
+    else {
+        res = copy_file_blocks(src_fd, inode, 0, data_blocks, src_size);
+    }
+    if (res != 0) {
+        // error reading from src file
+        return handle_failed_copy(new_inode_num, is_new_file, src_fd, EIO);
     }
+
+    // publish the size only once every block holds its data
     inode->i_size = src_size;
-    inode->i_blocks = ((src_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE) * (EXT2_BLOCK_SIZE / 512);
+    // i_blocks counts the indirect tables as well
+    inode->i_blocks = supply.taken * (EXT2_BLOCK_SIZE / 512);
+    mark_file_tables_dirty(inode);
+    mark_inode_dirty(new_inode_num);
     return 0;
 }
 
-int add_file_as_parent_dir_entry(int parent_inode_num, int new_inode_num, FILE* src_file, char* filename){
+int add_file_as_parent_dir_entry(int parent_inode_num, int new_inode_num, int src_fd, const char* filename, int filename_len){
     // add directory entry to parent directory
-    if (!has_space_in_parent_last_used_block(parent_inode_num, filename)) {
+    if (!has_space_in_parent_last_used_block(parent_inode_num, filename_len)) {
         // allocate new block for parent directory
         int new_parent_block = allocate_new_block_for_parent(parent_inode_num);
         if (new_parent_block == -1) {
             // no space left
             clear_inode_data_blocks(new_inode_num);
             release_inode(new_inode_num);
-            fclose(src_file);
+            close(src_fd);
             return ENOSPC;
         }
-        add_dir_entry_to_new_block(parent_inode_num, new_inode_num, filename, new_parent_block, EXT2_FT_REG_FILE);
+        add_dir_entry_to_new_block(parent_inode_num, new_inode_num, filename, filename_len, new_parent_block, EXT2_FT_REG_FILE);
     } 
     else {
         // last used block of parent dir has enough space
-        add_dir_entry_to_last_used_block(parent_inode_num, new_inode_num, filename, EXT2_FT_REG_FILE);
+        add_dir_entry_to_last_used_block(parent_inode_num, new_inode_num, filename, filename_len, EXT2_FT_REG_FILE);
     }
     return 0;
 }
 
-int32_t ext2_fsal_cp(const char *src,
-                     const char *dst)
+int copy_to_new_file(int parent_inode_num, int src_fd, const char* filename, int filename_len) {
+    // create a regular file named filename in the parent dir holding the content of src_fd
+    int new_inode_num = initialize_new_inode(parent_inode_num, INODE_MODE_FILE);
+    if (new_inode_num == -1) {
+        close(src_fd);
+        return ENOSPC;
+    }
+
+    int res = copy_file_to_parent_dir(parent_inode_num, new_inode_num, true, src_fd);
+    if (res != 0) {
+        return res;
+    }
+    return add_file_as_parent_dir_entry(parent_inode_num, new_inode_num, src_fd, filename, filename_len);
+}
+
+int overwrite_existing_file(int parent_inode_num, int inode_num, int src_fd) {
+    // replace the content of an existing file or symlink with the content of src_fd
+    // the file may have hard links in other directories, so lock the inode itself as well
+    lock_inode(inode_num, true);
+    // readers holding views of the old content go first
+    wait_for_inode_views(inode_num);
+    if (is_inode_to_symlink(inode_num)) {
+        // the symlink becomes a regular file
+        clear_inode_data_blocks(inode_num);
+        struct ext2_inode* symlink_inode = get_inode(inode_num);
+        symlink_inode->i_mode = EXT2_S_IFREG | 0644;
+        mark_inode_dirty(inode_num);
+    }
+    else {
+        // delete existing content
+        clear_inode_data_blocks(inode_num);
+    }
+    int res = copy_file_to_parent_dir(parent_inode_num, inode_num, false, src_fd);
+    unlock_inode(inode_num);
+    return res;
+}
+
+int32_t copy_file(const char *src, const char *dst)
 {
     /**
      * TODO: implement the ext2_cp command here ...
      * Arguments src and dst are the cp command arguments described in the handout.
      */
-    char* normalized_src_path = get_normalized_path(src);
-    FILE* src_file = fopen(src, "rb"); // source file is a file on native OS
-    if (src_file == NULL) {
+    int src_fd = open(src, O_RDONLY); // source file is a file on native OS
+    if (src_fd == -1) {
         // source file doesn't exist or cannot be opened
         return ENOENT;
     }
-    char* last_slash = strrchr(normalized_src_path, '/');
-    char src_file_name[strlen(normalized_src_path) + 1];
-    size_t src_file_name_len;
-    if (last_slash != NULL) {
-        src_file_name_len = strlen(last_slash + 1);
-        strncpy(src_file_name, last_slash + 1, src_file_name_len);
-        
-    } else {
-        src_file_name_len = strlen(normalized_src_path);
-        strncpy(src_file_name, normalized_src_path, src_file_name_len);
-    }
-    src_file_name[src_file_name_len] = '\0';
-    free(normalized_src_path);
-
-    char* normalized_dst_path = get_normalized_path(dst);
-    
-    int path_validation_res = validate_path_exists(normalized_dst_path);
-    
-    if (path_validation_res == -2) {
-        // an intermediate folder does not exist or exists as a file
-        free(normalized_dst_path);
-        fclose(src_file);
-        return ENOENT;
-    }
-
-
-    if (path_validation_res == -1) {
-        // last name of the path does not exist, 
-        // so modify the path to the immediate parent directory
-        char* path_to_traverse = get_path_to_parent(normalized_dst_path);
-        int parent_inode_num;
-        int child_inode_num;
-        traverse_path(path_to_traverse, &parent_inode_num, &child_inode_num);
-        free(path_to_traverse);
-        
-        // child_inode_num now stores the inode number of the immediate parent directory
-        parent_inode_num = child_inode_num; // for semantic and consistency
-
-        char* last_slash = strrchr(normalized_dst_path, '/');
-        char* filename = (last_slash != NULL) ? (last_slash + 1) : normalized_dst_path;
-
-        free(normalized_dst_path);
 
-        if (strlen(filename) > EXT2_NAME_LEN) {
-            fclose(src_file);
-            return ENAMETOOLONG;
-        }
-        // need to allocate inode for the new file
-
-        int new_inode_num = initialize_new_inode(INODE_MODE_FILE);
-        if (new_inode_num == -1) {
-            fclose(src_file);
-            return ENOSPC;
-        }
+    // name of the source file on the native OS, used when dst is a directory
+    const char* last_slash = strrchr(src, '/');
+    const char* src_file_name = (last_slash != NULL) ? (last_slash + 1) : src;
+    int src_file_name_len = strlen(src_file_name);
 
-        int res = copy_file_to_parent_dir(parent_inode_num, new_inode_num, src_file);
-        if (res != 0) {
-            return res;
-        }
-
-        res = add_file_as_parent_dir_entry(parent_inode_num, new_inode_num, src_file, filename);
-        if (res != 0) {
-            return res;
-        }
+    struct path_lookup dst_lookup;
+    resolve_path(dst, &dst_lookup, true);
 
-    }
-    else {
-        // path_validation_res = 0 at this point
-        // this means there exists a file/folder/symlink with same name
-
-        // traverse the path first
-        int parent_inode_num;
-        int child_inode_num;
-        traverse_path(normalized_dst_path, &parent_inode_num, &child_inode_num);
-
-        
-        if (is_inode_to_dir(child_inode_num)) {
-            // need to allocate inode for the new file
-
-            free(normalized_dst_path);
-            int new_inode_num = initialize_new_inode(INODE_MODE_FILE);
-            if (new_inode_num == -1) {
-                fclose(src_file);
-                return ENOSPC;
-            }
-
-            int res = copy_file_to_parent_dir(child_inode_num, new_inode_num, src_file);
-            if (res != 0) {
-                return res;
-            }
-
-            res = add_file_as_parent_dir_entry(child_inode_num, new_inode_num, src_file, src_file_name);
-            if (res != 0) {
-                return res;
-            }
-        }
-        else if (is_inode_to_file(child_inode_num)) {
-            // overwrite content
-            // delete existing content
-            clear_inode_data_blocks(child_inode_num);
-            char* last_slash = strrchr(normalized_dst_path, '/');
-            char* filename = (last_slash != NULL) ? (last_slash + 1) : normalized_dst_path;
-
-            free(normalized_dst_path);
+    int res = 0;
+    switch (dst_lookup.status) {
+    case PATH_BAD_PREFIX:
+        // an intermediate folder does not exist or exists as a file
+        close(src_fd);
+        return ENOENT;
 
-            if (strlen(filename) > EXT2_NAME_LEN) {
-                fclose(src_file);
+    case PATH_NAME_TOO_LONG:
+        close(src_fd);
+        return ENAMETOOLONG;
+
+    case PATH_MISSING:
+        // last name of the path does not exist, create it in the immediate parent directory
+        res = copy_to_new_file(dst_lookup.parent_inode_num, src_fd, dst_lookup.name, dst_lookup.name_len);
+        break;
+
+    case PATH_EXISTS:
+        // there exists a file/folder/symlink with same name
+        if (is_inode_to_dir(dst_lookup.child_inode_num)) {
+            // copy into the directory under the name of the source file
+            if (src_file_name_len > EXT2_NAME_LEN) {
+                release_path(&dst_lookup);
+                close(src_fd);
                 return ENAMETOOLONG;
             }
-            int res = copy_file_to_parent_dir(parent_inode_num, child_inode_num, src_file);
-            if (res != 0) {
-                return res;
+            hold_child_dir(&dst_lookup);
+            int dir_inode_num = dst_lookup.child_inode_num;
+            int existing_inode_num = get_child_inode_num(dir_inode_num, src_file_name, src_file_name_len);
+            if (existing_inode_num == -1) {
+                res = copy_to_new_file(dir_inode_num, src_fd, src_file_name, src_file_name_len);
             }
-
-        } 
-        else if (is_inode_to_symlink(child_inode_num)) {
-            // overwrite existing symlink
-            clear_inode_data_blocks(child_inode_num);
-
-            struct ext2_inode* symlink_inode = &inode_table[child_inode_num - 1];
-            symlink_inode->i_mode = EXT2_S_IFREG | 0644;
-
-            char* last_slash = strrch(normalized_dst_path, '/');
-            char* filename = (last_slash != NULL) ? (last_slash + 1) : normalized_dst_path;
-
-            free(normalized_dst_path);
-
-            if (strlen(filename) > EXT2_NAME_LEN) {
-                fclose(src_file);
-                return ENAMETOOLONG;
+            else if (is_inode_to_dir(existing_inode_num)) {
+                release_path(&dst_lookup);
+                close(src_fd);
+                return EISDIR;
             }
-
-            int res = copy_file_to_parent_dir(parent_inode_num, child_inode_num, src_file);
-            if (res != 0) {
-                return res;
+            else {
+                res = overwrite_existing_file(dir_inode_num, existing_inode_num, src_fd);
             }
         }
+        else {
+            // overwrite content of the existing file or symlink
+            res = overwrite_existing_file(dst_lookup.parent_inode_num, dst_lookup.child_inode_num, src_fd);
+        }
+        break;
+    }
+    release_path(&dst_lookup);
+    if (res != 0) {
+        // src_fd is closed by the failing helper
+        return res;
     }
-      
-    fclose(src_file);
+
+    close(src_fd);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int32_t ext2_fsal_cp(const char *src,
+                     const char *dst)
+{
+    // join the running journal transaction before taking any lock
+    begin_op();
+    int32_t res = copy_file(src, dst);
+    // make the changes durable as configured, with no lock held
+    commit_op();
+    return res;
+}
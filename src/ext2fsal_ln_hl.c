@@ -24,95 +24,91 @@
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
 extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char* inode_bitmap;
-extern struct ext2_inode *inode_table;
-extern pthread_mutex_t inode_bitmap_lock;
-extern pthread_mutex_t datablock_bitmap_lock;
 extern pthread_mutex_t superblock_lock;
 extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
 
 
-int32_t ext2_fsal_ln_hl(const char *src,
-                        const char *dst)
+int32_t link_hard(const char *src, const char *dst)
 {
     /**
      * TODO: implement the ext2_ln_hl command here ...
      * src and dst are the ln command arguments described in the handout.
      */
 
-    char* normalized_src_path = get_normalized_path(src);
-    int src_validation_res = validate_path_exists(normalized_src_path);
-    
-
-    if (src_validation_res != 0) {
-        free(normalized_src_path);
+    struct path_lookup src_lookup;
+    resolve_path(src, &src_lookup, false);
+    if (src_lookup.status != PATH_EXISTS) {
+        release_path(&src_lookup);
         return ENOENT;
     }
-    int src_parent_inode_num;
-    int src_child_inode_num;
-    traverse_path(normalized_src_path, &src_parent_inode_num, &src_child_inode_num);
+    int src_child_inode_num = src_lookup.child_inode_num;
     if (is_inode_to_dir(src_child_inode_num)) {
-        free(normalized_src_path);
+        release_path(&src_lookup);
         return EISDIR;
     }
-    free(normalized_src_path);
 
-    char* normalized_dst_path = get_normalized_path(dst);
-    int dst_validation_res = validate_path_exists(normalized_dst_path);
-    if (dst_validation_res == -2) {
-        free(normalized_dst_path);
-        return ENOENT;
+    // increment link count of source file before letting go of its directory,
+    // the extra link keeps the inode alive while the dst path is resolved
+    struct ext2_inode* src_inode = get_inode(src_child_inode_num);
+    lock_inode(src_child_inode_num, true);
+    src_inode->i_links_count++;
+    mark_inode_dirty(src_child_inode_num);
+    unlock_inode(src_child_inode_num);
+    release_path(&src_lookup);
+
+    struct path_lookup dst_lookup;
+    resolve_path(dst, &dst_lookup, true);
+    int res = 0;
+    if (dst_lookup.status == PATH_BAD_PREFIX) {
+        res = ENOENT;
     }
-    int dst_parent_inode_num;
-    int dst_child_inode_num;
-    if (dst_validation_res == 0) {
-        
-        traverse_path(normalized_dst_path, &dst_parent_inode_num, &dst_child_inode_num);
-        if (is_inode_to_file(dst_child_inode_num) || is_inode_to_symlink(dst_child_inode_num)) {
-            free(normalized_dst_path);
-            return EEXIST;
-        } 
-        else if (is_inode_to_dir(dst_child_inode_num)) {
-            free(normalized_dst_path);
-            return EISDIR;
-        }
+    else if (dst_lookup.status == PATH_NAME_TOO_LONG) {
+        // validate link name length
+        res = ENAMETOOLONG;
     }
-
-    char* dst_path_to_parent = get_path_to_parent(normalized_dst_path);
-    traverse_path(dst_path_to_parent, &dst_parent_inode_num, &dst_child_inode_num);
-    dst_parent_inode_num = dst_child_inode_num; // for semantic and consistency
-    free(dst_path_to_parent);
-    
-    // validate link name length
-    char* last_slash = strrchr(normalized_dst_path, '/');
-    char* link_name = (last_slash != NULL) ? (last_slash + 1) : normalized_dst_path;
-    
-    free(normalized_dst_path);
-
-    if (strlen(link_name) > EXT2_NAME_LEN) {
-        return ENAMETOOLONG;
+    else if (dst_lookup.status == PATH_EXISTS) {
+        res = is_inode_to_dir(dst_lookup.child_inode_num) ? EISDIR : EEXIST;
     }
+    else {
+        // only the last name of the dst path is not existing at this point
+        // add a directory enty in the dst parent dir to point to existing inode
+        int dst_parent_inode_num = dst_lookup.parent_inode_num;
+        const char* link_name = dst_lookup.name;
+        int link_name_len = dst_lookup.name_len;
 
-
-    // increment link count of source file
-    struct ext2_inode* src_inode = &inode_table[src_child_inode_num - 1];
-    src_inode->i_links_count++;
-
-    // add a directory enty in dst_parent_inode_num to point to existing inode
-    if (!has_space_in_parent_last_used_block(dst_parent_inode_num, link_name)) {
-        int new_parent_block = allocate_new_block_for_parent(dst_parent_inode_num);
-        if (new_parent_block == -1) {
-            // no space available
-            // undo all changes
-            src_inode->i_links_count--;
-            return ENOSPC;
+        if (!has_space_in_parent_last_used_block(dst_parent_inode_num, link_name_len)) {
+            int new_parent_block = allocate_new_block_for_parent(dst_parent_inode_num);
+            if (new_parent_block == -1) {
+                // no space available
+                res = ENOSPC;
+            }
+            else {
+                add_dir_entry_to_new_block(dst_parent_inode_num, src_child_inode_num, link_name, link_name_len, new_parent_block, EXT2_FT_REG_FILE);
+            }
+        } 
+        else {
+            add_dir_entry_to_last_used_block(dst_parent_inode_num, src_child_inode_num, link_name, link_name_len, EXT2_FT_REG_FILE);
         }
-        add_dir_entry_to_new_block(dst_parent_inode_num, src_child_inode_num, link_name, new_parent_block, EXT2_FT_REG_FILE);
-    } 
-    else {
-        add_dir_entry_to_last_used_block(dst_parent_inode_num, src_child_inode_num, link_name, EXT2_FT_REG_FILE);
     }
+    release_path(&dst_lookup);
 
-    return 0;
+    if (res != 0) {
+        // undo all changes, an rm in the meantime may have left the pin as the last link
+        lock_inode(src_child_inode_num, true);
+        drop_link(src_child_inode_num);
+        unlock_inode(src_child_inode_num);
+    }
+    return res;
+}
+
+int32_t ext2_fsal_ln_hl(const char *src,
+                        const char *dst)
+{
+    // join the running journal transaction before taking any lock
+    begin_op();
+    int32_t res = link_hard(src, dst);
+    // make the changes durable as configured, with no lock held
+    commit_op();
+    return res;
 }
@@ -24,17 +24,12 @@
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
 extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char* inode_bitmap;
-extern struct ext2_inode *inode_table;
-extern pthread_mutex_t inode_bitmap_lock;
-extern pthread_mutex_t datablock_bitmap_lock;
 extern pthread_mutex_t superblock_lock;
 extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
 
 
-int32_t ext2_fsal_ln_sl(const char *src,
-                        const char *dst)
+int32_t link_soft(const char *src, const char *dst)
 {
     /**
      * TODO: implement the ext2_ln_sl command here ...
@@ -42,91 +37,100 @@ int32_t ext2_fsal_ln_sl(const char *src,
      */
 
 
-    char* normalized_dst_path = get_normalized_path(dst);
-    int dst_validation_res = validate_path_exists(normalized_dst_path);
-    if (dst_validation_res == 0) {
-        int dst_parent_inode_num;
-        int dst_child_inode_num;
-        traverse_path(normalized_dst_path, &dst_parent_inode_num, &dst_child_inode_num);
-        if (is_inode_to_dir(dst_child_inode_num)) {
-            free(normalized_dst_path);
-            return EISDIR;
-        }
-        if (is_inode_to_file(dst_child_inode_num) || is_inode_to_symlink(dst_child_inode_num)) {
-            free(normalized_dst_path);
-            return EEXIST;
-        }
+    struct path_lookup dst_lookup;
+    resolve_path(dst, &dst_lookup, true);
+    if (dst_lookup.status == PATH_EXISTS) {
+        int res = is_inode_to_dir(dst_lookup.child_inode_num) ? EISDIR : EEXIST;
+        release_path(&dst_lookup);
+        return res;
     }
-    else if (dst_validation_res == -2) {
+    else if (dst_lookup.status == PATH_BAD_PREFIX) {
         // an intermediate folder along the dest path is missing
-        free(normalized_dst_path);
         return ENOENT;
     }
+    else if (dst_lookup.status == PATH_NAME_TOO_LONG) {
+        // validate link name's length
+        return ENAMETOOLONG;
+    }
 
     // only the last name of the dst path is not existing at this point
-    char* dst_path_to_parent = get_path_to_parent(normalized_dst_path);
-    int dst_parent_inode_num;
-    int dst_child_inode_num;
-    traverse_path(dst_path_to_parent, &dst_parent_inode_num, &dst_child_inode_num);
-    dst_parent_inode_num = dst_child_inode_num; // for semantic and consistency
-    free(dst_path_to_parent);
-    
-
-    // extract symlink name
-    char* last_slash = strrchr(normalized_dst_path, '/');
-    char* link_name = (last_slash != NULL) ? (last_slash + 1) : normalized_dst_path;
-
-    free(normalized_dst_path);
-
-    // validate link name's length
-    if (strlen(link_name) > EXT2_NAME_LEN) {
+    int dst_parent_inode_num = dst_lookup.parent_inode_num;
+    const char* link_name = dst_lookup.name;
+    int link_name_len = dst_lookup.name_len;
+
+    // the target path must fit in one block, with room for the terminating zero
+    size_t src_len = strlen(src);
+    if (src_len >= EXT2_BLOCK_SIZE) {
+        release_path(&dst_lookup);
         return ENAMETOOLONG;
     }
 
-    int symlink_inode_num = initialize_new_inode(INODE_MODE_LINK);
+    int symlink_inode_num = initialize_new_inode(dst_parent_inode_num, INODE_MODE_LINK);
     if (symlink_inode_num == -1) {
         // no space left for inode
+        release_path(&dst_lookup);
         return ENOSPC;
     }
-
-    int block_num = find_free_block();
-    if (block_num == -1) {
-        release_inode(symlink_inode_num);
-        return ENOSPC;
+    struct ext2_inode* symlink_inode = get_inode(symlink_inode_num);
+
+    // fast symlink: a target shorter than i_block[] is stored in i_block[] itself (zeroed by
+    // initialize_new_inode()), with no data block, like ext2 does
+    int block_num = -1;
+    if (src_len < sizeof(symlink_inode->i_block)) {
+        memcpy(symlink_inode->i_block, src, src_len);
+        symlink_inode->i_blocks = 0;
+    }
+    else {
+        // a zeroed block, so the target is zero terminated
+        block_num = find_zeroed_block(symlink_inode_num);
+        if (block_num == -1) {
+            release_inode(symlink_inode_num);
+            release_path(&dst_lookup);
+            return ENOSPC;
+        }
+        symlink_inode->i_block[0] = block_num;
+        memcpy(disk + (size_t) block_num * EXT2_BLOCK_SIZE, src, src_len);
+        symlink_inode->i_blocks = EXT2_BLOCK_SIZE / 512;
+        mark_blocks_dirty(block_num, 1);
     }
-
-    // get symlink inode and set block pointer to block_num
-    struct ext2_inode* symlink_inode = &inode_table[symlink_inode_num - 1];
-    symlink_inode->i_block[0] = block_num;
-
-    // write source path to block
-    unsigned char* block_ptr = (unsigned char*) (disk + block_num * EXT2_BLOCK_SIZE);
-    size_t src_len = strlen(src);
-    memcpy(block_ptr, src, src_len);
 
     // update inode metadata
     symlink_inode->i_size = src_len;
-    symlink_inode->i_blocks = EXT2_BLOCK_SIZE / 512;
+    mark_inode_dirty(symlink_inode_num);
 
     // add symlink to parent directory
-    if (!has_space_in_parent_last_used_block(dst_parent_inode_num, link_name)) {
+    if (!has_space_in_parent_last_used_block(dst_parent_inode_num, link_name_len)) {
         // find new block
         int new_parent_block = allocate_new_block_for_parent(dst_parent_inode_num);
         if (new_parent_block == -1) {
             // no space left available
             // undo all changes
-            memset(block_ptr, 0, src_len);
-            release_block(block_num);
+            if (block_num != -1) {
+                release_block(block_num);
+            }
             release_inode(symlink_inode_num);
+            release_path(&dst_lookup);
             return ENOSPC;
         }
 
-        add_dir_entry_to_new_block(dst_parent_inode_num, symlink_inode_num, link_name, new_parent_block, EXT2_FT_SYMLINK);
+        add_dir_entry_to_new_block(dst_parent_inode_num, symlink_inode_num, link_name, link_name_len, new_parent_block, EXT2_FT_SYMLINK);
     }
     else {
         // parent's last used block has enough space
-        add_dir_entry_to_last_used_block(dst_parent_inode_num, symlink_inode_num, link_name, EXT2_FT_SYMLINK);
+        add_dir_entry_to_last_used_block(dst_parent_inode_num, symlink_inode_num, link_name, link_name_len, EXT2_FT_SYMLINK);
     }
 
+    release_path(&dst_lookup);
     return 0;
 }
+
+int32_t ext2_fsal_ln_sl(const char *src,
+                        const char *dst)
+{
+    // join the running journal transaction before taking any lock
+    begin_op();
+    int32_t res = link_soft(src, dst);
+    // make the changes durable as configured, with no lock held
+    commit_op();
+    return res;
+}
@@ -23,24 +23,19 @@
 extern unsigned char *disk;
 extern struct ext2_super_block *sb;
 extern struct ext2_group_desc *gd;
-extern unsigned char *block_bitmap;
-extern unsigned char* inode_bitmap;
-extern struct ext2_inode *inode_table;
-extern pthread_mutex_t inode_bitmap_lock;
-extern pthread_mutex_t datablock_bitmap_lock;
 extern pthread_mutex_t superblock_lock;
 extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
 
 int initialize_dir_entry(uint32_t new_inode_num, uint32_t parent_inode_num) {
-    int new_dir_block = find_free_block();
+    // the block starts out zeroed
+    int new_dir_block = find_zeroed_block(new_inode_num);
     if (new_dir_block == -1) {
         return -1;
     }
 
-    struct ext2_inode* inode = &inode_table[new_inode_num - 1];
+    struct ext2_inode* inode = get_inode(new_inode_num);
     inode->i_block[0] = new_dir_block;
-    // zero out block
-    memset(disk + new_dir_block, 0, EXT2_BLOCK_SIZE);
 
     // create "." and ".." entries
     struct ext2_dir_entry* dot_entry = (struct ext2_dir_entry*) (disk + new_dir_block * EXT2_BLOCK_SIZE);
@@ -57,6 +52,9 @@ int initialize_dir_entry(uint32_t new_inode_num, uint32_t parent_inode_num) {
     dot_dot_entry->name[1] = '.';
     dot_dot_entry->file_type = EXT2_FT_DIR;
     dot_dot_entry->rec_len = EXT2_BLOCK_SIZE - 12;
+
+    mark_inode_dirty(new_inode_num);
+    mark_blocks_dirty(new_dir_block, 1);
     return 0;
 }
 void restore_parent_inode(int parent_inode_num, int new_block) {
@@ -66,7 +64,7 @@ void restore_parent_inode(int parent_inode_num, int new_block) {
     mark the allocated block as not in use
     */
     // since parent_inode is updated already, need to restore previous state
-    struct ext2_inode* parent_inode = &inode_table[parent_inode_num - 1];
+    struct ext2_inode* parent_inode = get_inode(parent_inode_num);
     bool found = false;
     int i = 0;
     while (!found) {
@@ -78,24 +76,20 @@ void restore_parent_inode(int parent_inode_num, int new_block) {
     }
     parent_inode->i_size -= EXT2_BLOCK_SIZE;
     parent_inode->i_blocks -= (EXT2_BLOCK_SIZE / 512);
+    mark_inode_dirty(parent_inode_num);
 
 }
 
-void handle_failed_initialize_new_inode(char* normalized_path, int parent_inode_num, int new_block) {
+void handle_failed_initialize_new_inode(int parent_inode_num, int new_block) {
     // no free inode remaining
-    // free normalized path
-    free(normalized_path);
-    
     restore_parent_inode(parent_inode_num, new_block);
     
     // release allocated block by updating bookkeeping structures
     release_block(new_block);
 }
 
-void handle_failed_initalize_dir_entry(char* normalized_path, int parent_inode_num, int new_inode_num, int new_block) {
+void handle_failed_initalize_dir_entry(int parent_inode_num, int new_inode_num, int new_block) {
     // no free block remaining
-    free(normalized_path);
-
     restore_parent_inode(parent_inode_num, new_block);
 
     // release allocated block and inode
@@ -104,106 +98,88 @@ void handle_failed_initalize_dir_entry(char* normalized_path, int parent_inode_n
 
 }
 
-int32_t ext2_fsal_mkdir(const char *path)
+int32_t make_dir(const char *path)
 {
     /**
      * TODO: implement the ext2_mkdir command here ...
      * the argument path is the path to the directory that is to be created.
      */
 
-    char* normalized_path = get_normalized_path(path);
-    
-    if (strcmp(normalized_path, "/") == 0) {
-        // user attempts to create another root directory => illegal
-        free(normalized_path);
+    struct path_lookup lookup;
+    resolve_path(path, &lookup, true);
+
+    if (lookup.status == PATH_EXISTS) {
+        // a directory or file with the same name already exists,
+        // this also covers attempts to create another root directory
+        release_path(&lookup);
         return EEXIST;
     }
-
-    int path_validation_res = validate_path_exists(normalized_path);
-    if (path_validation_res == -2) {
+    if (lookup.status == PATH_BAD_PREFIX) {
         // an intermediate folder does not exist or exists as a file
-        free(normalized_path);
         return ENOENT;
     }
-    if (path_validation_res == 0) {
-        // a directory or file with the same name already exists
-        free(normalized_path);
-        return EEXIST;
-    }
-    
-    // traverse the path to get to the parent dir
-    const char* delimiter = "/";
-    size_t path_len = strlen(normalized_path);
-    char path_copy[path_len + 1];
-    strncpy(path_copy, normalized_path, path_len);
-    path_copy[path_len] = '\0';
-    char* saveptr;
-    char* token = strtok_r(path_copy, delimiter, &saveptr);
-    int current_inode_num = EXT2_ROOT_INO;
-    int parent_inode_num = current_inode_num;
-    char dir_name[EXT2_NAME_LEN + 1];
-    while (token != NULL) {
-        int child_inode_num = get_child_inode_num(current_inode_num, token);
-        if (child_inode_num == -1) {
-            // save name of directory to be created then break
-            // verify valid name length first
-            if (strlen(token) > EXT2_NAME_LEN) {
-                free(normalized_path);
-                return ENAMETOOLONG;
-            }
-
-            strncpy(dir_name, token, strlen(token));
-            dir_name[strlen(token)] = '\0';
-            break;
-        }
-        parent_inode_num = current_inode_num;
-        current_inode_num = child_inode_num;
-        token = strtok_r(NULL, delimiter, &saveptr);
+    if (lookup.status == PATH_NAME_TOO_LONG) {
+        return ENAMETOOLONG;
     }
 
-    // parent_inode_num now holds the inode number of immediate parent directory
-    if (!has_space_in_parent_last_used_block(parent_inode_num, dir_name)) {
+    // lookup.parent_inode_num holds the inode number of immediate parent directory
+    int parent_inode_num = lookup.parent_inode_num;
+    if (!has_space_in_parent_last_used_block(parent_inode_num, lookup.name_len)) {
         int new_block = allocate_new_block_for_parent(parent_inode_num);
         if (new_block == -1) {
-            free(normalized_path);
+            release_path(&lookup);
             return ENOSPC; // no space left
         }
 
-        int new_inode_num = initialize_new_inode(INODE_MODE_DIR);
+        int new_inode_num = initialize_new_inode(parent_inode_num, INODE_MODE_DIR);
         if (new_inode_num == -1) {
-            handle_failed_initialize_new_inode(normalized_path, parent_inode_num, new_block);
+            handle_failed_initialize_new_inode(parent_inode_num, new_block);
+            release_path(&lookup);
             return ENOSPC; 
         }
 
         int res = initialize_dir_entry(new_inode_num, parent_inode_num);
         if (res == -1) {
-            handle_failed_initalize_dir_entry(normalized_path, parent_inode_num, new_inode_num, new_block);
+            handle_failed_initalize_dir_entry(parent_inode_num, new_inode_num, new_block);
+            release_path(&lookup);
             return ENOSPC; 
         }
-        add_dir_entry_to_new_block(parent_inode_num, new_inode_num, dir_name, new_block, EXT2_FT_DIR);
+        add_dir_entry_to_new_block(parent_inode_num, new_inode_num, lookup.name, lookup.name_len, new_block, EXT2_FT_DIR);
     }
     else {
         // there is enough space in parent's last used block
-        int new_inode_num = initialize_inode();
+        int new_inode_num = initialize_new_inode(parent_inode_num, INODE_MODE_DIR);
         if (new_inode_num == -1) {
-            free(normalized_path);
+            release_path(&lookup);
             return ENOSPC; // no free inode remaining
         }
         int res = initialize_dir_entry(new_inode_num, parent_inode_num);
         if (res == -1) {
             // no free block remaining
-            free(normalized_path);
-
             // release allocated inode
             release_inode(new_inode_num);
+            release_path(&lookup);
 
             return ENOSPC; 
         }
         // there is space in the last used block
-        add_dir_entry_to_last_used_block(parent_inode_num, new_inode_num, dir_name, EXT2_FT_DIR);
+        add_dir_entry_to_last_used_block(parent_inode_num, new_inode_num, lookup.name, lookup.name_len, EXT2_FT_DIR);
     }
 
-    free(normalized_path);
-    
+    // the ".." entry of the new directory links back to the parent
+    get_inode(parent_inode_num)->i_links_count++;
+    mark_inode_dirty(parent_inode_num);
+
+    release_path(&lookup);
     return 0;
+}
+
+int32_t ext2_fsal_mkdir(const char *path)
+{
+    // join the running journal transaction before taking any lock
+    begin_op();
+    int32_t res = make_dir(path);
+    // make the changes durable as configured, with no lock held
+    commit_op();
+    return res;
 }
\ No newline at end of file
@@ -0,0 +1,221 @@
+/*
+ *------------
+ * This code is provided solely for the personal and private use of
+ * students taking the CSC369H5 course at the University of Toronto.
+ * Copying for purposes other than this use is expressly prohibited.
+ * All forms of distribution of this code, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 MCS @ UTM
+ * -------------
+ */
+
+#include "ext2fsal.h"
+#include "e2fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+extern unsigned char *disk;
+extern struct ext2_super_block *sb;
+extern struct ext2_group_desc *gd;
+extern pthread_mutex_t superblock_lock;
+extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
+
+// what holes in a file read as
+static const unsigned char zero_block[EXT2_BLOCK_SIZE];
+
+
+static int hold_existing(const char *path, struct path_lookup *lookup)
+{
+    /*
+    Return value interpretation:
+    0: path exists and lookup holds a read lock on its inode (release with release_path())
+    ENOENT: path does not exist, nothing is held
+    */
+    resolve_path(path, lookup, false);
+    if (lookup->status != PATH_EXISTS) {
+        release_path(lookup);
+        return ENOENT;
+    }
+    hold_child_for_read(lookup);
+    return 0;
+}
+
+int32_t ext2_fsal_stat(const char *path, struct ext2_fsal_stat *st)
+{
+    struct path_lookup lookup;
+    int res = hold_existing(path, &lookup);
+    if (res != 0) {
+        return res;
+    }
+
+    struct ext2_inode *inode = get_inode(lookup.child_inode_num);
+    st->ino = lookup.child_inode_num;
+    st->mode = inode->i_mode;
+    st->links = inode->i_links_count;
+    st->size = inode->i_size;
+    st->blocks = inode->i_blocks;
+    st->atime = inode->i_atime;
+    st->ctime = inode->i_ctime;
+    st->mtime = inode->i_mtime;
+    release_path(&lookup);
+    return 0;
+}
+
+int32_t ext2_fsal_readdir(const char *path, uint64_t *cursor, void *buf, size_t len, size_t *filled)
+{
+    struct path_lookup lookup;
+    *filled = 0;
+    int res = hold_existing(path, &lookup);
+    if (res != 0) {
+        return res;
+    }
+    if (!is_inode_to_dir(lookup.child_inode_num)) {
+        release_path(&lookup);
+        return ENOTDIR;
+    }
+
+    // the cursor is a byte position in the directory, the next record is the first live
+    // entry starting at or after it; entries only move towards the start of their block
+    // (see remove_dir_entry()), so a returned entry is never passed again
+    struct ext2_inode *dir = get_inode(lookup.child_inode_num);
+    unsigned char *out = buf;
+    uint64_t pos = *cursor;
+    uint32_t num_blocks = dir->i_size / EXT2_BLOCK_SIZE;
+    while (pos < (uint64_t) num_blocks * EXT2_BLOCK_SIZE && pos / EXT2_BLOCK_SIZE < EXT2_NDIR_BLOCKS) {
+        uint32_t block = pos / EXT2_BLOCK_SIZE;
+        uint32_t start = pos % EXT2_BLOCK_SIZE;
+        if (dir->i_block[block] == 0) {
+            pos = (uint64_t) (block + 1) * EXT2_BLOCK_SIZE;
+            continue;
+        }
+
+        unsigned char *dir_block = disk + (size_t) dir->i_block[block] * EXT2_BLOCK_SIZE;
+        unsigned int offset = 0;
+        while (offset < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry*) (dir_block + offset);
+            if (dir_entry->rec_len == 0) {
+                break; // corrupted block, do not loop forever
+            }
+            if (offset < start || !is_inode_in_use(dir_entry->inode)) {
+                offset += dir_entry->rec_len;
+                continue;
+            }
+
+            // the header, the name and its terminating zero, rounded up to 8 bytes
+            size_t rec_len = (sizeof(struct ext2_fsal_dirent) + dir_entry->name_len + 1 + 7) & ~(size_t) 7;
+            if (*filled + rec_len > len) {
+                *cursor = (uint64_t) block * EXT2_BLOCK_SIZE + offset;
+                release_path(&lookup);
+                // an empty page means the caller's buffer cannot hold even this record
+                return *filled == 0 ? EINVAL : 0;
+            }
+            struct ext2_fsal_dirent *record = (struct ext2_fsal_dirent*) (out + *filled);
+            record->ino = dir_entry->inode;
+            record->rec_len = rec_len;
+            record->name_len = dir_entry->name_len;
+            record->file_type = dir_entry->file_type;
+            memcpy(record->name, dir_entry->name, dir_entry->name_len);
+            record->name[dir_entry->name_len] = '\0';
+            *filled += rec_len;
+            offset += dir_entry->rec_len;
+        }
+        pos = (uint64_t) (block + 1) * EXT2_BLOCK_SIZE;
+    }
+
+    *cursor = pos;
+    release_path(&lookup);
+    return 0;
+}
+
+int32_t ext2_fsal_read(const char *path, uint64_t offset, uint64_t len,
+                       struct iovec *iov, int *iovcnt, uint64_t *bytes, uint32_t *view)
+{
+    struct path_lookup lookup;
+    int max_iov = *iovcnt;
+    *iovcnt = 0;
+    *bytes = 0;
+    // no view unless the call succeeds, so releasing *view is always safe
+    *view = 0;
+    if (max_iov <= 0) {
+        return EINVAL;
+    }
+    int res = hold_existing(path, &lookup);
+    if (res != 0) {
+        return res;
+    }
+    if (is_inode_to_dir(lookup.child_inode_num)) {
+        release_path(&lookup);
+        return EISDIR;
+    }
+
+    // pinned under the read lock, so no writer is halfway through the file
+    pin_inode_views(lookup.child_inode_num);
+    *view = lookup.child_inode_num;
+
+    struct ext2_inode *inode = get_inode(lookup.child_inode_num);
+    uint64_t size = inode->i_size;
+    if (offset >= size) {
+        release_path(&lookup);
+        return 0;
+    }
+    if (len > size - offset) {
+        len = size - offset;
+    }
+
+    if (is_inode_to_symlink(lookup.child_inode_num) && inode->i_blocks == 0) {
+        // a fast symlink keeps its target in the block pointers of the inode
+        iov[0].iov_base = (unsigned char*) inode->i_block + offset;
+        iov[0].iov_len = len;
+        *iovcnt = 1;
+        *bytes = len;
+        release_path(&lookup);
+        return 0;
+    }
+
+    int used = 0;
+    while (*bytes < len) {
+        uint64_t pos = offset + *bytes;
+        uint32_t in_block = pos % EXT2_BLOCK_SIZE;
+        uint64_t chunk = EXT2_BLOCK_SIZE - in_block;
+        if (chunk > len - *bytes) {
+            chunk = len - *bytes;
+        }
+        uint32_t block_num = get_file_block(inode, pos / EXT2_BLOCK_SIZE);
+        unsigned char *base = block_num == 0 ? (unsigned char*) zero_block
+                                             : disk + (size_t) block_num * EXT2_BLOCK_SIZE + in_block;
+
+        // blocks laid out back to back in the image share one entry
+        if (used > 0 && block_num != 0 &&
+            (unsigned char*) iov[used - 1].iov_base + iov[used - 1].iov_len == base) {
+            iov[used - 1].iov_len += chunk;
+        }
+        else {
+            if (used == max_iov) {
+                break;
+            }
+            iov[used].iov_base = base;
+            iov[used].iov_len = chunk;
+            used++;
+        }
+        *bytes += chunk;
+    }
+
+    *iovcnt = used;
+    release_path(&lookup);
+    return 0;
+}
+
+void ext2_fsal_read_release(uint32_t view)
+{
+    if (view == 0 || view > sb->s_inodes_count) {
+        return;
+    }
+    unpin_inode_views(view);
+}
@@ -18,17 +18,57 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
+extern unsigned char *disk;
+extern struct ext2_super_block *sb;
+extern struct ext2_group_desc *gd;
+extern pthread_mutex_t superblock_lock;
+extern pthread_mutex_t group_desc_lock;
+extern pthread_rwlock_t *inode_locks;
 
-int32_t ext2_fsal_rm(const char *path)
+
+int32_t remove_file(const char *path)
 {
     /**
      * TODO: implement the ext2_rm command here ...
      * the argument 'path' is the path to the file to be removed.
      */
 
-     /* This is just to avoid compilation warnings, remove this line when you're done. */
-    (void)path;
+    struct path_lookup lookup;
+    resolve_path(path, &lookup, true);
+    if (lookup.status != PATH_EXISTS) {
+        // a missing file, an intermediate folder that does not exist or a name too long to exist
+        release_path(&lookup);
+        return ENOENT;
+    }
+    int inode_num = lookup.child_inode_num;
+    if (is_inode_to_dir(inode_num)) {
+        // this also covers the root directory
+        release_path(&lookup);
+        return EISDIR;
+    }
 
+    // the file may have hard links in other directories, so lock the inode itself as well
+    lock_inode(inode_num, true);
+    if (!remove_dir_entry(lookup.parent_inode_num, lookup.name, lookup.name_len)) {
+        unlock_inode(inode_num);
+        release_path(&lookup);
+        return ENOENT;
+    }
+    // the last link puts the inode on the orphan list, its blocks are released in the background
+    drop_link(inode_num);
+    unlock_inode(inode_num);
+    release_path(&lookup);
     return 0;
-}
\ No newline at end of file
+}
+
+int32_t ext2_fsal_rm(const char *path)
+{
+    // join the running journal transaction before taking any lock
+    begin_op();
+    int32_t res = remove_file(path);
+    // make the changes durable as configured, with no lock held
+    commit_op();
+    return res;
+}
@@ -0,0 +1,289 @@
+/*
+ * Helpers shared by the tests in this directory: each test is a program that runs its
+ * scenarios in child processes, since the file system is initialized once per process,
+ * and checks the images they leave behind.
+ */
+
+#pragma once
+
+#include "../ext2fsal.h"
+#include "../ext2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+// what the tests start from: 128 blocks of 1 KiB, 105 of them free, 32 inodes
+#define TEST_EMPTY_IMAGE "../img/emptydisk.img"
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+            test_failures++;                                                        \
+        }                                                                           \
+    } while (0)
+
+static inline void copy_image(const char *from, const char *to)
+{
+    // fresh copy of an image, without the journal of an earlier run
+    char buf[65536];
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in == -1 || out == -1) {
+        perror(from);
+        exit(1);
+    }
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            perror(to);
+            exit(1);
+        }
+    }
+    close(in);
+    close(out);
+
+    char journal[4096];
+    snprintf(journal, sizeof(journal), "%s.journal", to);
+    unlink(journal);
+}
+
+static inline void write_source(const char *path, size_t size, unsigned seed)
+{
+    // host file of size bytes of a pattern that depends on seed
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (size_t i = 0; i < size; i++) {
+        fputc((int) ((i * 2654435761u + seed * 40503u) >> 7) & 0xff, f);
+    }
+    fclose(f);
+}
+
+// A minimal read-only ext2 reader, so the tests check what reached the image file without
+// going through the code under test. Images are read after the scenario that wrote them
+// exited or called ext2_fsal_destroy().
+struct test_image {
+    unsigned char *disk;
+    size_t size;
+    const struct ext2_super_block *sb;
+};
+
+static inline int open_test_image(const char *image, struct test_image *img)
+{
+    int fd = open(image, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(image);
+        exit(1);
+    }
+    img->size = st.st_size;
+    img->disk = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img->disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    img->sb = (const struct ext2_super_block *) (img->disk + 1024);
+    return 0;
+}
+
+static inline const struct ext2_inode *test_inode(const struct test_image *img, uint32_t ino)
+{
+    const struct ext2_group_desc *gd =
+        (const struct ext2_group_desc *) (img->disk + (img->sb->s_first_data_block + 1) * EXT2_BLOCK_SIZE);
+    uint32_t group = (ino - 1) / img->sb->s_inodes_per_group;
+    uint32_t index = (ino - 1) % img->sb->s_inodes_per_group;
+    uint32_t inode_size = (img->sb->s_rev_level == 0) ? sizeof(struct ext2_inode) : img->sb->s_inode_size;
+    return (const struct ext2_inode *) (img->disk + (size_t) gd[group].bg_inode_table * EXT2_BLOCK_SIZE
+                                        + (size_t) index * inode_size);
+}
+
+static inline uint32_t test_file_block(const struct test_image *img, const struct ext2_inode *inode, uint64_t idx)
+{
+    // block holding block idx of the file, 0 for a hole
+    if (idx < EXT2_NDIR_BLOCKS) {
+        return inode->i_block[idx];
+    }
+    uint64_t per_table = EXT2_BLOCK_SIZE / sizeof(uint32_t);
+    uint64_t span = 1;
+    int depth;
+    idx -= EXT2_NDIR_BLOCKS;
+    for (depth = 1; depth <= 3 && idx >= span * per_table; depth++) {
+        idx -= span * per_table;
+        span *= per_table;
+    }
+    uint32_t block = inode->i_block[EXT2_IND_BLOCK + depth - 1];
+    for (; depth > 0 && block != 0; depth--) {
+        block = ((const uint32_t *) (img->disk + (size_t) block * EXT2_BLOCK_SIZE))[idx / span];
+        idx %= span;
+        span /= per_table;
+    }
+    return block;
+}
+
+static inline uint32_t test_lookup(const struct test_image *img, const char *path)
+{
+    // inode number of path, 0 if it does not exist
+    uint32_t ino = EXT2_ROOT_INO;
+    while (*path != '\0') {
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+        size_t len = strcspn(path, "/");
+        const struct ext2_inode *dir = test_inode(img, ino);
+        if ((dir->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+            return 0;
+        }
+        uint32_t found = 0;
+        for (uint64_t b = 0; b < (dir->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE && found == 0; b++) {
+            uint32_t block = test_file_block(img, dir, b);
+            for (uint32_t off = 0; block != 0 && off < EXT2_BLOCK_SIZE;) {
+                const struct ext2_dir_entry *entry =
+                    (const struct ext2_dir_entry *) (img->disk + (size_t) block * EXT2_BLOCK_SIZE + off);
+                if (entry->rec_len == 0) {
+                    break;
+                }
+                if (entry->inode != 0 && entry->name_len == len && memcmp(entry->name, path, len) == 0) {
+                    found = entry->inode;
+                    break;
+                }
+                off += entry->rec_len;
+            }
+        }
+        if (found == 0) {
+            return 0;
+        }
+        ino = found;
+        path += len;
+    }
+    return ino;
+}
+
+static inline uint32_t image_inode(const char *image, const char *path, struct ext2_inode *copy)
+{
+    // inode number of path in image and, if copy is not NULL, its inode; 0 if it does not exist
+    struct test_image img;
+    open_test_image(image, &img);
+    uint32_t ino = test_lookup(&img, path);
+    if (ino != 0 && copy != NULL) {
+        memcpy(copy, test_inode(&img, ino), sizeof(*copy));
+    }
+    munmap(img.disk, img.size);
+    return ino;
+}
+
+static inline int image_exists(const char *image, const char *path)
+{
+    return image_inode(image, path, NULL) != 0;
+}
+
+static inline int image_holds(const char *image, const char *path, const void *data, size_t len)
+{
+    // 1 if the file (or symbolic link target) at path in image is exactly len bytes of data
+    struct test_image img;
+    open_test_image(image, &img);
+    uint32_t ino = test_lookup(&img, path);
+    const struct ext2_inode *inode = (ino != 0) ? test_inode(&img, ino) : NULL;
+    int same = inode != NULL && inode->i_size == len;
+    if (same && (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == 0) {
+        // a fast symlink keeps its target in the block pointers
+        same = memcmp(inode->i_block, data, len) == 0;
+    }
+    else {
+        for (uint64_t pos = 0; same && pos < len; pos++) {
+            uint32_t block = test_file_block(&img, inode, pos / EXT2_BLOCK_SIZE);
+            unsigned char byte = (block == 0) ? 0 : img.disk[(size_t) block * EXT2_BLOCK_SIZE + pos % EXT2_BLOCK_SIZE];
+            same = byte == ((const unsigned char *) data)[pos];
+        }
+    }
+    munmap(img.disk, img.size);
+    return same;
+}
+
+static inline int image_same_content(const char *image, const char *path, const char *source)
+{
+    // 1 if the file at path in image holds exactly what the host file source holds
+    int fd = open(source, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(source);
+        exit(1);
+    }
+    char *data = malloc(st.st_size + 1);
+    if (data == NULL || read(fd, data, st.st_size) != st.st_size) {
+        perror(source);
+        exit(1);
+    }
+    close(fd);
+    int same = image_holds(image, path, data, st.st_size);
+    free(data);
+    return same;
+}
+
+static inline void check_image(const char *image)
+{
+    // e2fsck finds nothing to fix in image; skipped where e2fsck is not installed
+    if (system("command -v e2fsck >/dev/null 2>&1") != 0) {
+        return;
+    }
+    char command[4096];
+    snprintf(command, sizeof(command), "e2fsck -fn %s >/dev/null 2>&1", image);
+    if (system(command) != 0) {
+        fprintf(stderr, "e2fsck found errors in %s\n", image);
+        test_failures++;
+    }
+}
+
+static inline int run_child(void (*scenario)(void *), void *arg)
+{
+    // runs scenario in a child process, returns its exit status (-1 if it was killed)
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        test_failures = 0;
+        scenario(arg);
+        exit(test_failures > 0);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "scenario killed by signal %d\n", WTERMSIG(status));
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static inline void replay_image(void *image)
+{
+    // scenario: init replays what a crashed writer left in the journal of image, destroy
+    // writes the result back to it
+    ext2_fsal_init(image);
+    ext2_fsal_destroy();
+}
+
+static inline int finish_test(const char *name)
+{
+    // report and exit status of main()
+    printf("%s: %s\n", name, test_failures == 0 ? "ok" : "FAILED");
+    return test_failures != 0;
+}
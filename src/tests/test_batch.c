@@ -0,0 +1,73 @@
+/*
+ * ext2_fsal_submit_batch(): results and commit of a batch where some operations fail.
+ */
+
+#include "test.h"
+
+#define IMAGE "/tmp/ext2fsal_test_batch.img"
+#define SOURCE "/tmp/ext2fsal_test_batch_src"
+
+// mkdir /a fails the second time, the cp into /b fails since /b is never created, and
+// the rm and ln name nothing that exists; the rest succeeds around them
+static const struct ext2_fsal_op mixed_ops[] = {
+    { EXT2_FSAL_OP_MKDIR, "/a", NULL },
+    { EXT2_FSAL_OP_MKDIR, "/a", NULL },
+    { EXT2_FSAL_OP_CP, SOURCE, "/a/f" },
+    { EXT2_FSAL_OP_CP, SOURCE, "/b/f" },
+    { EXT2_FSAL_OP_RM, "/missing", NULL },
+    { EXT2_FSAL_OP_LN_HL, "/missing", "/h" },
+    { EXT2_FSAL_OP_LN_SL, "/a/f", "/s" },
+    { EXT2_FSAL_OP_LN_HL, "/a/f", "/a/g" },
+};
+static const int32_t mixed_results[] = { 0, EEXIST, 0, ENOENT, ENOENT, ENOENT, 0, 0 };
+#define MIXED_OPS (sizeof(mixed_ops) / sizeof(mixed_ops[0]))
+
+static void write_mixed_batch(void *arg)
+{
+    // runs the batch and exits without ext2_fsal_destroy(), like a crash right after it
+    struct ext2_fsal_options options;
+    memset(&options, 0, sizeof(options));
+    options.journal = true;
+    options.durability = EXT2_FSAL_DURABILITY_PER_OP;
+    ext2_fsal_init_with_options(IMAGE, &options);
+    int32_t results[MIXED_OPS];
+    memset(results, 0x55, sizeof(results));
+    CHECK(ext2_fsal_submit_batch(mixed_ops, MIXED_OPS, results) == EEXIST);
+    for (uint32_t i = 0; i < MIXED_OPS; i++) {
+        if (results[i] != mixed_results[i]) {
+            fprintf(stderr, "op %u: result %d, expected %d\n", i, results[i], mixed_results[i]);
+            test_failures++;
+        }
+    }
+    // without results, only the first error is reported
+    struct ext2_fsal_op again[] = { { EXT2_FSAL_OP_RM, "/missing", NULL }, { EXT2_FSAL_OP_MKDIR, "/c", NULL } };
+    CHECK(ext2_fsal_submit_batch(again, 2, NULL) == ENOENT);
+    _exit(test_failures > 0);
+}
+
+static void test_mixed_batch(void)
+{
+    // after replay, what succeeded is there and what failed left nothing behind
+    write_source(SOURCE, 3000, 7);
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    CHECK(run_child(write_mixed_batch, NULL) == 0);
+    CHECK(run_child(replay_image, IMAGE) == 0);
+    struct ext2_inode f;
+    CHECK(image_exists(IMAGE, "/a"));
+    CHECK(image_same_content(IMAGE, "/a/f", SOURCE));
+    uint32_t ino = image_inode(IMAGE, "/a/f", &f);
+    CHECK(ino != 0 && f.i_links_count == 2);
+    CHECK(image_inode(IMAGE, "/a/g", NULL) == ino);
+    CHECK(image_holds(IMAGE, "/s", "/a/f", 4));
+    CHECK(image_exists(IMAGE, "/c"));
+    CHECK(!image_exists(IMAGE, "/b"));
+    CHECK(!image_exists(IMAGE, "/h"));
+    CHECK(!image_exists(IMAGE, "/missing"));
+    check_image(IMAGE);
+}
+
+int main(void)
+{
+    test_mixed_batch();
+    return finish_test("test_batch");
+}
@@ -0,0 +1,81 @@
+/*
+ * What the image holds without a journal: the server never calls ext2_fsal_destroy(), so
+ * every operation has to leave the image consistent on its own, and a file copied into
+ * blocks that were freed but not zeroed yet must not show their old content.
+ */
+
+#include "test.h"
+
+#define IMAGE "/tmp/ext2fsal_test_image.img"
+
+static void write_without_destroy(void *arg)
+{
+    // default options, no journal; exits like the server does, without ext2_fsal_destroy()
+    ext2_fsal_init(IMAGE);
+    CHECK(ext2_fsal_mkdir("/a") == 0);
+    CHECK(ext2_fsal_mkdir("/a/b") == 0);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_a", "/a/f") == 0);
+    CHECK(ext2_fsal_ln_hl("/a/f", "/a/b/h") == 0);
+    CHECK(ext2_fsal_ln_sl("/a/f", "/s") == 0);
+    // frees the blocks of the first copy
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_b", "/a/f") == 0);
+    _exit(test_failures > 0);
+}
+
+static void test_counts_without_destroy(void)
+{
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    write_source("/tmp/ext2fsal_test_a", 20 * 1024, 1);
+    write_source("/tmp/ext2fsal_test_b", 5 * 1024 + 17, 2);
+    CHECK(run_child(write_without_destroy, NULL) == 0);
+    CHECK(image_same_content(IMAGE, "/a/b/h", "/tmp/ext2fsal_test_b"));
+    // the free counts in the super block and group descriptor match the bitmaps
+    check_image(IMAGE);
+}
+
+static void write_into_freed_blocks(void *arg)
+{
+    // /f and /filler take every free block, so the new content of /f goes to a block its
+    // old content had, most likely before the scrubber zeroed it
+    struct ext2_fsal_options options;
+    memset(&options, 0, sizeof(options));
+    options.lazy_zeroing = true;
+    ext2_fsal_init_with_options(IMAGE, &options);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_a", "/f") == 0);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_filler", "/filler") == 0);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_b", "/f") == 0);
+    ext2_fsal_destroy();
+}
+
+static void test_tail_zeroed(void)
+{
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    write_source("/tmp/ext2fsal_test_a", 12 * 1024, 3);
+    write_source("/tmp/ext2fsal_test_filler", 92 * 1024, 4);
+    write_source("/tmp/ext2fsal_test_b", 100, 5);
+    CHECK(run_child(write_into_freed_blocks, NULL) == 0);
+    CHECK(image_same_content(IMAGE, "/f", "/tmp/ext2fsal_test_b"));
+
+    // the last block holds nothing past the end of the file
+    struct test_image img;
+    open_test_image(IMAGE, &img);
+    uint32_t ino = test_lookup(&img, "/f");
+    uint32_t block = (ino != 0) ? test_file_block(&img, test_inode(&img, ino), 0) : 0;
+    CHECK(block != 0);
+    for (uint32_t off = 100; block != 0 && off < EXT2_BLOCK_SIZE; off++) {
+        if (img.disk[(size_t) block * EXT2_BLOCK_SIZE + off] != 0) {
+            fprintf(stderr, "byte %u of block %u past the end of /f is not zero\n", off, block);
+            test_failures++;
+            break;
+        }
+    }
+    munmap(img.disk, img.size);
+    check_image(IMAGE);
+}
+
+int main(void)
+{
+    test_counts_without_destroy();
+    test_tail_zeroed();
+    return finish_test("test_image");
+}
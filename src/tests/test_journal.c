@@ -0,0 +1,244 @@
+/*
+ * Journal replay after a crash: the writer runs with the journal on and exits without
+ * ext2_fsal_destroy(), so nothing is checkpointed, and the checker replays what it left.
+ */
+
+#include "test.h"
+
+#define IMAGE "/tmp/ext2fsal_test_journal.img"
+
+static void init_journaled(void)
+{
+    struct ext2_fsal_options options;
+    memset(&options, 0, sizeof(options));
+    options.journal = true;
+    options.durability = EXT2_FSAL_DURABILITY_PER_OP;
+    ext2_fsal_init_with_options(IMAGE, &options);
+}
+
+static void write_reused_table(void *arg)
+{
+    // the indirect table of /a is journaled, freed by rm and then holds data of /b
+    init_journaled();
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_a", "/a") == 0);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_filler", "/filler") == 0);
+    CHECK(ext2_fsal_rm("/a") == 0);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_c", "/c") == 0);
+    CHECK(ext2_fsal_cp("/tmp/ext2fsal_test_b", "/b") == 0);
+    _exit(test_failures > 0);
+}
+
+static void test_revoked_table(void)
+{
+    // /a (13 blocks and its table) and /filler take every free block, so /c and /b land
+    // where /a was and the last block of /b is the old table
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    write_source("/tmp/ext2fsal_test_a", 13 * 1024, 1);
+    write_source("/tmp/ext2fsal_test_filler", 90 * 1024, 2);
+    write_source("/tmp/ext2fsal_test_c", 1024, 3);
+    write_source("/tmp/ext2fsal_test_b", 12 * 1024, 4);
+    CHECK(run_child(write_reused_table, NULL) == 0);
+    CHECK(run_child(replay_image, IMAGE) == 0);
+    CHECK(image_same_content(IMAGE, "/b", "/tmp/ext2fsal_test_b"));
+    CHECK(image_same_content(IMAGE, "/c", "/tmp/ext2fsal_test_c"));
+    CHECK(image_same_content(IMAGE, "/filler", "/tmp/ext2fsal_test_filler"));
+    CHECK(!image_exists(IMAGE, "/a"));
+    check_image(IMAGE);
+}
+
+// The crash test: a writer runs a fixed sequence of operations and is killed at some point;
+// after replay, every operation that returned is there, and the one running at the kill
+// either is or is not. Iteration i of the sequence copies a source to /f<i>, links it as
+// /d<i % 4>/h<i> and /s<i>, then removes the names of iteration i - 2.
+#define CRASH_ROUNDS 24
+#define CRASH_ITERATIONS 200
+#define CRASH_OPS_PER_ITERATION 6
+#define CRASH_DIRS 4
+
+static const char *crash_sources[3] = { "/tmp/ext2fsal_test_a", "/tmp/ext2fsal_test_b", "/tmp/ext2fsal_test_c" };
+
+enum crash_op_type { CRASH_CP, CRASH_LN_HL, CRASH_LN_SL, CRASH_RM };
+
+struct crash_op {
+    enum crash_op_type type;
+    char src[64];
+    char dst[64];
+};
+
+static int crash_op(uint32_t index, struct crash_op *op)
+{
+    // operation index of the sequence, 0 if that step does nothing
+    uint32_t i = index / CRASH_OPS_PER_ITERATION;
+    memset(op, 0, sizeof(*op));
+    switch (index % CRASH_OPS_PER_ITERATION) {
+    case 0:
+        op->type = CRASH_CP;
+        snprintf(op->src, sizeof(op->src), "%s", crash_sources[i % 3]);
+        snprintf(op->dst, sizeof(op->dst), "/f%u", i);
+        return 1;
+    case 1:
+        op->type = CRASH_LN_HL;
+        snprintf(op->src, sizeof(op->src), "/f%u", i);
+        snprintf(op->dst, sizeof(op->dst), "/d%u/h%u", i % CRASH_DIRS, i);
+        return 1;
+    case 2:
+        op->type = CRASH_LN_SL;
+        snprintf(op->src, sizeof(op->src), "/f%u", i);
+        snprintf(op->dst, sizeof(op->dst), "/s%u", i);
+        return 1;
+    case 3:
+        op->type = CRASH_RM;
+        snprintf(op->src, sizeof(op->src), "/f%u", i - 2);
+        return i >= 2;
+    case 4:
+        op->type = CRASH_RM;
+        snprintf(op->src, sizeof(op->src), "/d%u/h%u", (i - 2) % CRASH_DIRS, i - 2);
+        return i >= 2;
+    default:
+        op->type = CRASH_RM;
+        snprintf(op->src, sizeof(op->src), "/s%u", i - 2);
+        return i >= 2;
+    }
+}
+
+static int32_t run_crash_op(const struct crash_op *op)
+{
+    switch (op->type) {
+    case CRASH_CP:
+        return ext2_fsal_cp(op->src, op->dst);
+    case CRASH_LN_HL:
+        return ext2_fsal_ln_hl(op->src, op->dst);
+    case CRASH_LN_SL:
+        return ext2_fsal_ln_sl(op->src, op->dst);
+    default:
+        return ext2_fsal_rm(op->src);
+    }
+}
+
+struct crash_round {
+    volatile uint32_t *done;    // operations that returned, shared with the parent
+    enum ext2_fsal_durability durability;
+};
+
+static void write_until_killed(void *arg)
+{
+    struct crash_round *round = arg;
+    struct ext2_fsal_options options;
+    memset(&options, 0, sizeof(options));
+    options.journal = true;
+    options.durability = round->durability;
+    ext2_fsal_init_with_options(IMAGE, &options);
+    for (uint32_t d = 0; d < CRASH_DIRS; d++) {
+        char dir[16];
+        snprintf(dir, sizeof(dir), "/d%u", d);
+        if (ext2_fsal_mkdir(dir) != 0) {
+            _exit(1);
+        }
+    }
+    __atomic_store_n(round->done, 0, __ATOMIC_RELEASE);
+    for (uint32_t index = 0; index < CRASH_ITERATIONS * CRASH_OPS_PER_ITERATION; index++) {
+        struct crash_op op;
+        if (crash_op(index, &op) && run_crash_op(&op) != 0) {
+            _exit(1);
+        }
+        __atomic_store_n(round->done, index + 1, __ATOMIC_RELEASE);
+    }
+    _exit(0);
+}
+
+static int crash_touches(const struct crash_op *op, const char *name)
+{
+    // 1 if op may have changed what name is, with the hard link its inode
+    if (strcmp(op->dst, name) == 0 || (op->type == CRASH_RM && strcmp(op->src, name) == 0)) {
+        return 1;
+    }
+    return op->type == CRASH_LN_HL && strcmp(op->src, name) == 0;
+}
+
+static void check_after_crash(uint32_t done)
+{
+    // compares every name the sequence used with what it should be in the replayed image
+    struct crash_op running;
+    if (!crash_op(done, &running)) {
+        memset(&running, 0, sizeof(running));
+    }
+    uint32_t last = done / CRASH_OPS_PER_ITERATION + 1;
+    for (uint32_t i = 0; i <= last && i < CRASH_ITERATIONS; i++) {
+        // name i exists once its creating step returned and until its removing step returned
+        char names[3][64];
+        snprintf(names[0], sizeof(names[0]), "/f%u", i);
+        snprintf(names[1], sizeof(names[1]), "/d%u/h%u", i % CRASH_DIRS, i);
+        snprintf(names[2], sizeof(names[2]), "/s%u", i);
+        uint32_t ino[2] = { 0, 0 };
+        for (int n = 0; n < 3; n++) {
+            uint32_t created = i * CRASH_OPS_PER_ITERATION + n;
+            uint32_t removed = (i + 2) * CRASH_OPS_PER_ITERATION + 3 + n;
+            int expected = done > created && done <= removed;
+            if (crash_touches(&running, names[n])) {
+                continue;
+            }
+            uint32_t found = image_inode(IMAGE, names[n], NULL);
+            if ((found != 0) != expected) {
+                fprintf(stderr, "after %u operations: %s %s\n", done, names[n], found ? "exists" : "is missing");
+            }
+            CHECK((found != 0) == expected);
+            if (!found || !expected) {
+                continue;
+            }
+            if (n < 2) {
+                CHECK(image_same_content(IMAGE, names[n], crash_sources[i % 3]));
+                ino[n] = found;
+            }
+            else {
+                CHECK(image_holds(IMAGE, names[n], names[0], strlen(names[0])));
+            }
+        }
+        CHECK(ino[0] == 0 || ino[1] == 0 || ino[0] == ino[1]);
+    }
+}
+
+static void test_crash_and_replay(void)
+{
+    write_source("/tmp/ext2fsal_test_a", 13 * 1024 + 100, 5);
+    write_source("/tmp/ext2fsal_test_b", 2 * 1024, 6);
+    write_source("/tmp/ext2fsal_test_c", 0, 7);
+    volatile uint32_t *done = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (done == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    uint32_t kills = 0;
+    for (int r = 0; r < CRASH_ROUNDS; r++) {
+        copy_image(TEST_EMPTY_IMAGE, IMAGE);
+        struct crash_round round = { done, (r % 2 == 0) ? EXT2_FSAL_DURABILITY_PER_OP : EXT2_FSAL_DURABILITY_GROUP };
+        *done = 0;
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0) {
+            write_until_killed(&round);
+        }
+        // kill it a little later each round, somewhere inside the sequence
+        usleep(2000 + r * 1500);
+        kill(pid, SIGKILL);
+        int status;
+        waitpid(pid, &status, 0);
+        CHECK(WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) == 0));
+        kills += WIFSIGNALED(status);
+
+        CHECK(run_child(replay_image, IMAGE) == 0);
+        check_after_crash(__atomic_load_n(done, __ATOMIC_ACQUIRE));
+        // the replay shut down cleanly, so the image must be consistent as well
+        check_image(IMAGE);
+    }
+    // most rounds must actually have crashed for the test to mean anything
+    CHECK(kills >= CRASH_ROUNDS / 2);
+    munmap((void *) done, sizeof(uint32_t));
+}
+
+int main(void)
+{
+    test_revoked_table();
+    test_crash_and_replay();
+    return finish_test("test_journal");
+}
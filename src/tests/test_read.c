@@ -0,0 +1,142 @@
+/*
+ * ext2_fsal_read() views: the content they show stays put until they are released, while
+ * the file is overwritten or removed.
+ */
+
+#include "test.h"
+
+#include <pthread.h>
+
+#define IMAGE "/tmp/ext2fsal_test_read.img"
+#define OLD_SOURCE "/tmp/ext2fsal_test_read_old"
+#define NEW_SOURCE "/tmp/ext2fsal_test_read_new"
+#define FILE_SIZE (20 * 1024)
+
+static int overwrite_done = 0;
+
+static void* overwrite_file(void *arg)
+{
+    CHECK(ext2_fsal_cp(NEW_SOURCE, "/f") == 0);
+    __atomic_store_n(&overwrite_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int view_matches(const struct iovec *iov, int iovcnt, const char *source)
+{
+    // 1 if the entries hold exactly the first bytes of the host file source
+    FILE *f = fopen(source, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    int same = 1;
+    for (int i = 0; i < iovcnt; i++) {
+        const unsigned char *data = iov[i].iov_base;
+        for (size_t j = 0; j < iov[i].iov_len; j++) {
+            if (fgetc(f) != data[j]) {
+                same = 0;
+            }
+        }
+    }
+    fclose(f);
+    return same;
+}
+
+static void overwrite_while_viewed(void *arg)
+{
+    // a cp over the file waits for the view, which keeps showing the old content
+    ext2_fsal_init(IMAGE);
+    CHECK(ext2_fsal_cp(OLD_SOURCE, "/f") == 0);
+    struct iovec iov[32];
+    int iovcnt = 32;
+    uint64_t bytes;
+    uint32_t view;
+    CHECK(ext2_fsal_read("/f", 0, FILE_SIZE, iov, &iovcnt, &bytes, &view) == 0);
+    CHECK(bytes == FILE_SIZE);
+
+    pthread_t writer;
+    CHECK(pthread_create(&writer, NULL, overwrite_file, NULL) == 0);
+    usleep(200000);
+    CHECK(!__atomic_load_n(&overwrite_done, __ATOMIC_ACQUIRE));
+    CHECK(view_matches(iov, iovcnt, OLD_SOURCE));
+    ext2_fsal_read_release(view);
+    pthread_join(writer, NULL);
+    CHECK(overwrite_done);
+    ext2_fsal_destroy();
+}
+
+static void remove_while_viewed(void *arg)
+{
+    // rm returns at once, but the blocks are only released with the view; copies made
+    // meanwhile take other blocks
+    ext2_fsal_init(IMAGE);
+    CHECK(ext2_fsal_cp(OLD_SOURCE, "/f") == 0);
+    struct iovec iov[32];
+    int iovcnt = 32;
+    uint64_t bytes;
+    uint32_t view;
+    CHECK(ext2_fsal_read("/f", 0, FILE_SIZE, iov, &iovcnt, &bytes, &view) == 0);
+    CHECK(ext2_fsal_rm("/f") == 0);
+    struct ext2_fsal_stat st;
+    CHECK(ext2_fsal_stat("/f", &st) == ENOENT);
+    usleep(100000);
+    CHECK(ext2_fsal_cp(NEW_SOURCE, "/g") == 0);
+    CHECK(ext2_fsal_cp(NEW_SOURCE, "/h") == 0);
+    CHECK(view_matches(iov, iovcnt, OLD_SOURCE));
+    ext2_fsal_read_release(view);
+
+    // the blocks come back once the view is gone
+    CHECK(ext2_fsal_rm("/g") == 0);
+    CHECK(ext2_fsal_rm("/h") == 0);
+    ext2_fsal_destroy();
+}
+
+static void read_without_view(void *arg)
+{
+    // a failed read leaves no view, and a read past the end of the file still holds one
+    ext2_fsal_init(IMAGE);
+    CHECK(ext2_fsal_cp(OLD_SOURCE, "/f") == 0);
+    CHECK(ext2_fsal_mkdir("/d") == 0);
+    struct iovec iov[1];
+    int iovcnt = 1;
+    uint64_t bytes;
+    uint32_t view = 1;
+    CHECK(ext2_fsal_read("/missing", 0, 1, iov, &iovcnt, &bytes, &view) == ENOENT && view == 0);
+    view = 1;
+    iovcnt = 1;
+    CHECK(ext2_fsal_read("/d", 0, 1, iov, &iovcnt, &bytes, &view) == EISDIR && view == 0);
+    view = 1;
+    iovcnt = 0;
+    CHECK(ext2_fsal_read("/f", 0, 1, iov, &iovcnt, &bytes, &view) == EINVAL && view == 0);
+    ext2_fsal_read_release(view);
+
+    iovcnt = 1;
+    CHECK(ext2_fsal_read("/f", FILE_SIZE, 1, iov, &iovcnt, &bytes, &view) == 0 && bytes == 0 && view != 0);
+    ext2_fsal_read_release(view);
+    // a cp over the file would wait forever for a view that was not released
+    CHECK(ext2_fsal_cp(NEW_SOURCE, "/f") == 0);
+    ext2_fsal_destroy();
+}
+
+static void test_views(void)
+{
+    write_source(OLD_SOURCE, FILE_SIZE, 11);
+    write_source(NEW_SOURCE, FILE_SIZE, 12);
+
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    CHECK(run_child(overwrite_while_viewed, NULL) == 0);
+    CHECK(image_same_content(IMAGE, "/f", NEW_SOURCE));
+    check_image(IMAGE);
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    CHECK(run_child(remove_while_viewed, NULL) == 0);
+    check_image(IMAGE);
+    copy_image(TEST_EMPTY_IMAGE, IMAGE);
+    CHECK(run_child(read_without_view, NULL) == 0);
+    CHECK(image_same_content(IMAGE, "/f", NEW_SOURCE));
+    check_image(IMAGE);
+}
+
+int main(void)
+{
+    test_views();
+    return finish_test("test_read");
+}